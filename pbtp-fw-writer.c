@@ -5,45 +5,288 @@
  * Copyright (C) 2018 Vasily Khoruzhick <anarsoul@gmail.com>
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* sched_setaffinity() */
+#endif
+
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <hidapi.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <linux/usbdevice_fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "pbtp-sim.h"
+
+/*
+ * USDT probes for bpftrace and perf, built in when sys/sdt.h is
+ * available. A probe nobody is attached to is a single nop and its
+ * arguments are not evaluated otherwise.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#else
+#define DTRACE_PROBE2(provider, name, a1, a2)
+#define DTRACE_PROBE4(provider, name, a1, a2, a3, a4)
+#define DTRACE_PROBE5(provider, name, a1, a2, a3, a4, a5)
+#endif
 
 #define RETRIES 5
+#define FIRMWARE_SIZE (14 * 1024)
+#define BLOCK_SIZE 2048
+#define REPORT_PACING_US 10000
+#define SERIAL_ERASE_US 200000
+#define REALTIME_PRIORITY 10	/* above normal load, below IRQ threads */
+#define SERIAL_FROM_POOL -2
 #define USB_DEVICE_VID 0x258a
 #define USB_DEVICE_PID 0x000c
 
+/* Exit codes besides EXIT_SUCCESS and EXIT_FAILURE */
+#define EXIT_BAD_IMAGE		2	/* firmware file has wrong size or format */
+#define EXIT_NO_DEVICE		3	/* device is missing or not responding */
+#define EXIT_REPORT_SIZE	4	/* device does not accept request size */
+#define EXIT_SERIAL		5	/* serial number area is not readable */
+#define EXIT_ROLLED_BACK	6	/* flashing failed, previous firmware restored */
+#define EXIT_NOT_READY		7	/* device did not come back after programming */
+#define EXIT_LINK		8	/* link failed the probe before erase */
+#define EXIT_BUSY		9	/* device is locked by another writer */
+#define EXIT_NO_VARIANT		10	/* no variant of the bundle matches the device */
+
+/* HID usages of the interfaces the device has in normal operation */
+#define USAGE_PAGE_GENERIC_DESKTOP	0x01
+#define USAGE_MOUSE			0x02
+#define USAGE_KEYBOARD			0x06
+
 static char *firmware_file;
-static bool do_read, do_write;
+static bool do_read, do_write, do_rollback, batch_mode, all_devices;
+static char *journal_file;
+static char *script_file;
+static char *serial_pool;
+static int journal_fd = -1;
+static long int ready_timeout;
+static long int report_timeout, phase_timeout;
+static long int per_hub;
+static long int histogram_resolution;
+static char *histogram_file;
+static char *capture_file, *replay_file;
+static bool replay_fast;
+static long int realtime_cpu = -1;
+static unsigned long soak_count, soak_seconds;
+static char *timing_cache;
+static bool calibrate;
+static bool reset_on_timeout;
+static const char *lock_dir = "/run/lock";
+static long int lock_wait;
+static char *daemon_socket;
+static char *output_dir;
+static const char *device_select;
+static char *trace_file;
+static long int max_retries = RETRIES;
+static long int simulate;
+static struct sim_timing sim_timing;
+static struct sim_faults sim_faults;
+
+struct device {
+	hid_device *hid;
+	struct sim_device *sim;		/* instead of hid with --simulate */
+	char *path;
+	int index;			/* in captures, 0 unless --all */
+	const char *phase;		/* name of the current step */
+	unsigned int addr;		/* of the next 0x06 report */
+	uint64_t phase_deadline;	/* us, 0 if unbounded */
+	uint64_t last_report;		/* us, when the last report completed */
+	unsigned short release;		/* bcdDevice of the controller */
+	long int pacing_us, serial_erase_us;	/* see timing_load() */
+	uint64_t opened;		/* us */
+	uint64_t bytes;			/* sent and requested, failures included */
+	uint64_t phase_start, phase_bytes;
+	uint64_t recovery_us, recovery_bytes;	/* spent on failed attempts */
+	unsigned long short_reports, failed_reports;
+	char port[32];			/* USB port path, empty if unknown */
+	int lock_fd;			/* see device_lock(), -1 if none */
+	int tier;			/* recovery in progress, -1 if none */
+	uint64_t tier_start;
+	unsigned long tier_count[3];
+	uint64_t tier_us[3];
+	unsigned long retries;		/* failed attempts */
+	unsigned char record[8];	/* serial number area as last read */
+	bool have_record;
+	uint32_t image_crc;		/* of the image written or verified, 0 if none */
+	uint64_t trace_start;		/* us, of the traced operation, 0 if opened */
+	struct {
+		unsigned long retries, failed_reports, short_reports;
+		uint64_t recovery_us;
+	} trace_base;			/* counters when the operation began */
+	struct {
+		const char *name;
+		uint64_t us;
+	} phase_times[8];
+	int nphase_times;
+	long int request_size;		/* found out by a bundle, 0 to use -s */
+};
+
+/*
+ * Every report needed to write and verify an image, built once and then
+ * only read, so it can be shared by any number of devices and retries.
+ */
+struct flash_plan {
+	long int length;
+	int nblocks;
+	uint32_t crc;
+	unsigned char *image;		/* expected readback */
+	unsigned char *read_header;	/* 0x52 for the whole image */
+	unsigned char **write_headers;	/* 0x57 starting at each block */
+	unsigned char (*frames)[BLOCK_SIZE + 2];
+	unsigned char commit_frame[BLOCK_SIZE + 2];
+};
 static long int request_size;
 
 static void usage(int argc, char *argv[])
 {
 	fprintf(stderr, "Usage: %s [options]\n\n"
-	       "-w file | --write file		Write firmware from file to the device\n"
+	       "-w file | --write file		Write firmware or the matching variant of a bundle from file to the device\n"
 	       "-r file | --read file		Read firmware from device to the file\n"
-	       "-s size | --request_size size	Set feature request size (see documentation)\n"
-	       "-h | --help		Print this message\n", argv[0]);
+	       "-s size | --request_size size	Set feature request size (see documentation), optional with bundles\n"
+	       "-b | --rollback		Restore current firmware if writing fails\n"
+	       "-j file | --journal file	Record write progress for this device in file and resume from it\n"
+	       "-y | --yes		Batch mode: run pre-flight checks instead of the countdown\n"
+	       "-a | --all		Write firmware to all attached devices at once\n"
+	       "-x file | --script file	Run commands from file (- for stdin) on one open device\n"
+	       "--serial-pool file	Assign serial numbers from pool file after writing\n"
+	       "--histogram us		Print per-command report latency histograms with us wide buckets\n"
+	       "--histogram-file file	Also save histograms to file as CSV\n"
+	       "--per-hub n		With --all, write or verify at most n devices behind one hub at a time\n"
+	       "-t ms | --wait-ready ms	After writing wait up to ms for the device to come back\n"
+	       "--report-timeout ms	Fail a feature report that takes longer than ms\n"
+	       "--phase-timeout ms	Fail an erase, write, verify or serial update attempt that takes longer than ms\n"
+	       "--reset-on-timeout	Abort timed out reports by resetting the device, then re-open it\n"
+	       "--capture file		Record every feature report with its timing to file\n"
+	       "--replay file		Play a capture back against simulated touchpads\n"
+	       "--replay-fast		Replay without reproducing the captured timing\n"
+	       "--realtime cpu		Run on cpu under SCHED_FIFO with memory locked and report pacing jitter\n"
+	       "--soak n | --soak secs	Read firmware n times, or for secs seconds with an s suffix, and report link quality\n"
+	       "--timing-cache file	Use pacing and serial erase wait calibrated for the device's port from file\n"
+	       "--trace-log file	Append a JSON record of every operation on a device to file\n"
+	       "--device path|port	Use the touchpad with this hidapi path or USB port path, e.g. 1-1.4\n"
+	       "--daemon socket		Run jobs sent by clients of the UNIX socket, see README\n"
+	       "--output-dir dir	Daemon: create files that read jobs save in dir\n"
+	       "--lock-dir dir		Keep per-port device locks in dir (default /run/lock)\n"
+	       "--lock-wait ms		Wait up to ms for a device another writer holds instead of failing\n"
+	       "--calibrate		With -w, find the fastest reliable timing for the port and save it to the timing cache\n"
+	       "--retries n		Retry a failed write, verify or backup n times (default %d)\n"
+	       "--simulate n		Use n simulated touchpads instead of USB devices\n"
+	       "--sim-timing spec	Simulated timing in us: report=,frame=,program=,erase=,serial-erase=\n"
+	       "--sim-faults spec	Inject faults: short=p,timeout=p,corrupt=p,opcode=n,block=n,hang=ms,seed=n\n"
+	       "-h | --help		Print this message\n", argv[0], RETRIES);
 }
 
-static const char short_options[] = "w:r:s:h";
+enum {
+	OPT_REPORT_TIMEOUT = 256,
+	OPT_PHASE_TIMEOUT,
+	OPT_RESET_ON_TIMEOUT,
+	OPT_PER_HUB,
+	OPT_SERIAL_POOL,
+	OPT_HISTOGRAM,
+	OPT_HISTOGRAM_FILE,
+	OPT_RETRIES,
+	OPT_SIMULATE,
+	OPT_SIM_TIMING,
+	OPT_SIM_FAULTS,
+	OPT_CAPTURE,
+	OPT_REPLAY,
+	OPT_REPLAY_FAST,
+	OPT_REALTIME,
+	OPT_SOAK,
+	OPT_TIMING_CACHE,
+	OPT_CALIBRATE,
+	OPT_LOCK_DIR,
+	OPT_LOCK_WAIT,
+	OPT_DAEMON,
+	OPT_OUTPUT_DIR,
+	OPT_DEVICE,
+	OPT_TRACE_LOG,
+};
+
+static const char short_options[] = "w:r:s:bj:yax:t:h";
 
 static const struct option long_options[] = {
 	{"write", required_argument, NULL, 'w'},
 	{"read", required_argument, NULL, 'r'},
 	{"request_size", required_argument, NULL, 's'},
+	{"rollback", no_argument, NULL, 'b'},
+	{"journal", required_argument, NULL, 'j'},
+	{"yes", no_argument, NULL, 'y'},
+	{"all", no_argument, NULL, 'a'},
+	{"script", required_argument, NULL, 'x'},
+	{"wait-ready", required_argument, NULL, 't'},
+	{"report-timeout", required_argument, NULL, OPT_REPORT_TIMEOUT},
+	{"phase-timeout", required_argument, NULL, OPT_PHASE_TIMEOUT},
+	{"reset-on-timeout", no_argument, NULL, OPT_RESET_ON_TIMEOUT},
+	{"per-hub", required_argument, NULL, OPT_PER_HUB},
+	{"serial-pool", required_argument, NULL, OPT_SERIAL_POOL},
+	{"histogram", required_argument, NULL, OPT_HISTOGRAM},
+	{"histogram-file", required_argument, NULL, OPT_HISTOGRAM_FILE},
+	{"retries", required_argument, NULL, OPT_RETRIES},
+	{"simulate", required_argument, NULL, OPT_SIMULATE},
+	{"sim-timing", required_argument, NULL, OPT_SIM_TIMING},
+	{"sim-faults", required_argument, NULL, OPT_SIM_FAULTS},
+	{"capture", required_argument, NULL, OPT_CAPTURE},
+	{"replay", required_argument, NULL, OPT_REPLAY},
+	{"replay-fast", no_argument, NULL, OPT_REPLAY_FAST},
+	{"realtime", required_argument, NULL, OPT_REALTIME},
+	{"soak", required_argument, NULL, OPT_SOAK},
+	{"timing-cache", required_argument, NULL, OPT_TIMING_CACHE},
+	{"calibrate", no_argument, NULL, OPT_CALIBRATE},
+	{"lock-dir", required_argument, NULL, OPT_LOCK_DIR},
+	{"lock-wait", required_argument, NULL, OPT_LOCK_WAIT},
+	{"daemon", required_argument, NULL, OPT_DAEMON},
+	{"output-dir", required_argument, NULL, OPT_OUTPUT_DIR},
+	{"device", required_argument, NULL, OPT_DEVICE},
+	{"trace-log", required_argument, NULL, OPT_TRACE_LOG},
 	{"help", no_argument, NULL, 'h'},
 	{NULL, 0, 0, 0}
 };
 
+static long int parse_timeout(int argc, char *argv[])
+{
+	long int timeout = strtol(optarg, NULL, 0);
+
+	if (errno == ERANGE || timeout <= 0) {
+		fprintf(stderr, "Invalid timeout: %s\n\n", optarg);
+		usage(argc, argv);
+		exit(EXIT_FAILURE);
+	}
+
+	return timeout;
+}
+
 void options_init(int argc, char *argv[])
 {
+	sim_default_timing(&sim_timing);
+	sim_default_faults(&sim_faults);
+
 	for (;;) {
 		int index;
 		int c;
@@ -77,6 +320,146 @@ void options_init(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'b':
+			do_rollback = true;
+			break;
+		case 'j':
+			journal_file = strdup(optarg);
+			break;
+		case 'y':
+			batch_mode = true;
+			break;
+		case 'a':
+			all_devices = true;
+			break;
+		case 'x':
+			script_file = strdup(optarg);
+			break;
+		case 't':
+			ready_timeout = parse_timeout(argc, argv);
+			break;
+		case OPT_REPORT_TIMEOUT:
+			report_timeout = parse_timeout(argc, argv);
+			break;
+		case OPT_PHASE_TIMEOUT:
+			phase_timeout = parse_timeout(argc, argv);
+			break;
+		case OPT_RESET_ON_TIMEOUT:
+			reset_on_timeout = true;
+			break;
+		case OPT_HISTOGRAM:
+			histogram_resolution = strtol(optarg, NULL, 0);
+			if (errno == ERANGE || histogram_resolution <= 0) {
+				fprintf(stderr, "Invalid histogram resolution: %s\n\n", optarg);
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_HISTOGRAM_FILE:
+			histogram_file = strdup(optarg);
+			break;
+		case OPT_SERIAL_POOL:
+			serial_pool = strdup(optarg);
+			break;
+		case OPT_RETRIES:
+			max_retries = strtol(optarg, NULL, 0);
+			if (errno == ERANGE || max_retries < 0) {
+				fprintf(stderr, "Invalid number of retries: %s\n\n", optarg);
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_SIMULATE:
+			simulate = strtol(optarg, NULL, 0);
+			if (errno == ERANGE || simulate <= 0) {
+				fprintf(stderr, "Invalid number of simulated devices: %s\n\n", optarg);
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_SIM_TIMING:
+			if (sim_parse_timing(&sim_timing, optarg)) {
+				fprintf(stderr, "Invalid simulated timing: %s\n\n", optarg);
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_SIM_FAULTS:
+			if (sim_parse_faults(&sim_faults, optarg)) {
+				fprintf(stderr, "Invalid fault spec: %s\n\n", optarg);
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_CAPTURE:
+			capture_file = strdup(optarg);
+			break;
+		case OPT_REPLAY:
+			replay_file = strdup(optarg);
+			break;
+		case OPT_REPLAY_FAST:
+			replay_fast = true;
+			break;
+		case OPT_REALTIME:
+			realtime_cpu = strtol(optarg, NULL, 0);
+			if (errno == ERANGE || realtime_cpu < 0) {
+				fprintf(stderr, "Invalid CPU: %s\n\n", optarg);
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_SOAK: {
+			char *end;
+			long int n = strtol(optarg, &end, 0);
+
+			if (errno == ERANGE || n <= 0 || (*end && strcmp(end, "s"))) {
+				fprintf(stderr, "Invalid soak length: %s\n\n", optarg);
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			if (*end)
+				soak_seconds = n;
+			else
+				soak_count = n;
+			break;
+		}
+		case OPT_TIMING_CACHE:
+			timing_cache = strdup(optarg);
+			break;
+		case OPT_CALIBRATE:
+			calibrate = true;
+			break;
+		case OPT_TRACE_LOG:
+			trace_file = strdup(optarg);
+			break;
+		case OPT_DAEMON:
+			daemon_socket = strdup(optarg);
+			break;
+		case OPT_OUTPUT_DIR:
+			output_dir = strdup(optarg);
+			break;
+		case OPT_DEVICE:
+			device_select = strdup(optarg);
+			break;
+		case OPT_LOCK_DIR:
+			lock_dir = strdup(optarg);
+			break;
+		case OPT_LOCK_WAIT:
+			lock_wait = strtol(optarg, NULL, 0);
+			if (errno == ERANGE || lock_wait < 0) {
+				fprintf(stderr, "Invalid lock wait: %s\n\n", optarg);
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_PER_HUB:
+			per_hub = strtol(optarg, NULL, 0);
+			if (errno == ERANGE || per_hub <= 0) {
+				fprintf(stderr, "Invalid number of devices per hub: %s\n\n", optarg);
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'h':
 			usage(argc, argv);
 			exit(EXIT_SUCCESS);
@@ -87,364 +470,4374 @@ void options_init(int argc, char *argv[])
 	}
 }
 
-int do_read_fw(hid_device *handle, unsigned char *data, long int data_lenght)
+static uint64_t now_us(void)
 {
-#define READ_BLOCK_SIZE 2048
-	unsigned char report_data[request_size];
-	unsigned char command[READ_BLOCK_SIZE + 2];
-	int res;
+	struct timespec ts;
 
-	report_data[0] = 0x05; /* report id */
-	report_data[1] = 0x52;
-	report_data[2] = 0x00;
-	report_data[3] = 0x00;
-	report_data[4] = data_lenght & 0xff;
-	report_data[5] = (data_lenght >> 8) & 0xff;
-	
-	res = hid_send_feature_report(handle, report_data, request_size);
-	if (res != request_size) {
-		fprintf(stderr, "Failed to send read command\n");
-		return res;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	for (int i = 0; i < data_lenght / READ_BLOCK_SIZE; i++)
-	{
-		memset(command, 0, sizeof(command));
-		command[0] = 0x06;
-		command[1] = 0x72;
+/* How late sleeps to an absolute deadline wake up */
+static struct {
+	unsigned long count;
+	uint64_t total_us, max_us;
+} jitter;
 
-		res = hid_get_feature_report(handle, command, sizeof(command));
-		if (res != sizeof(command)) {
-			fprintf(stderr, "Failed to read back data: %d\n", res);
-			return res;
-		}
-		usleep(10000);
-		memcpy(data + i * READ_BLOCK_SIZE, command + 2, READ_BLOCK_SIZE);
-	}
+static void sleep_until(uint64_t deadline)
+{
+	struct timespec ts;
+	uint64_t late;
 
-	return 0;
+	if (deadline <= now_us())
+		return;
+
+	ts.tv_sec = deadline / 1000000;
+	ts.tv_nsec = (deadline % 1000000) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+
+	late = now_us() - deadline;
+	jitter.count++;
+	jitter.total_us += late;
+	if (late > jitter.max_us)
+		jitter.max_us = late;
 }
 
-void read_fw(void)
+static void jitter_print(void)
 {
-	const long int data_lenght = 14 * 1024;
-	unsigned char read_data[data_lenght];
-	FILE *out;
-	int res, data_left;
-	ssize_t written;
+	if (!jitter.count)
+		return;
 
-	hid_device *handle;
+	fprintf(stderr, "Pacing: %lu sleeps, woke up %llu us late on average, %llu us at most\n",
+		jitter.count, (unsigned long long)(jitter.total_us / jitter.count),
+		(unsigned long long)jitter.max_us);
+}
 
-	out = fopen(firmware_file, "wb");
-	if (!out) {
-		fprintf(stderr, "Failed to open %s for write\n", firmware_file);
-		exit(EXIT_FAILURE);
-	}
+/*
+ * Keep station load from stretching report pacing: pin to one CPU, lock
+ * memory so page faults do not stall transfers and run as SCHED_FIFO.
+ */
+static int realtime_init(void)
+{
+	struct sched_param param;
 
+#ifdef __linux__
+	cpu_set_t set;
 
-	handle = hid_open(USB_DEVICE_VID, USB_DEVICE_PID, NULL);
-	if (!handle) {
-		fprintf(stderr, "Failed to open device\n");
-		goto err_out_file;
+	CPU_ZERO(&set);
+	CPU_SET(realtime_cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		fprintf(stderr, "Failed to run on CPU %ld: %s\n", realtime_cpu,
+			strerror(errno));
+		return -1;
 	}
+#else
+	fprintf(stderr, "CPU pinning is only supported on Linux\n");
+	return -1;
+#endif
 
-	res = do_read_fw(handle, read_data, data_lenght);
-	if (res) {
-		fprintf(stderr, "Failed to read data\n");
-		goto err_out;
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		fprintf(stderr, "Failed to lock memory: %s\n", strerror(errno));
+		return -1;
 	}
 
-	data_left = data_lenght;
-	do {
-		written = fwrite(read_data + (data_left - data_lenght), 1, 1024, out);
-		data_left -= written;
-	} while (written && data_left);
-
-	if (data_left) {
-		fprintf(stderr, "Failed to write file, data left: %d\n", data_left);
-		goto err_out;
+	param.sched_priority = REALTIME_PRIORITY;
+	if (sched_setscheduler(0, SCHED_FIFO, &param)) {
+		fprintf(stderr, "Failed to switch to SCHED_FIFO: %s\n", strerror(errno));
+		return -1;
 	}
 
-	hid_close(handle);
-	return;
-
-err_out:
-	hid_close(handle);
-err_out_file:
-	fclose(out);
-	exit(EXIT_FAILURE);
+	return 0;
 }
 
-int do_write_serial_number(hid_device *handle)
+#ifdef __linux__
+static int read_sysfs_uint(const char *dir, const char *attr, unsigned int *val)
 {
-	unsigned char report_data[request_size];
-	uint16_t vid, pid, serial_num;
+	char file[PATH_MAX + 16];
+	FILE *f;
 	int res;
 
-	/* Set address and lenght */
-	report_data[0] = 0x05; /* report id */
-	report_data[1] = 0x52;
-	report_data[2] = 0x80;
-	report_data[3] = 0xff;
-	report_data[4] = 0x08;
-	report_data[5] = 0x00;
-	
-	res = hid_send_feature_report(handle, report_data, request_size);
-	if (res != request_size) {
-		fprintf(stderr, "Failed to send 'set address and len' command\n");
-		return res;
-	}
+	snprintf(file, sizeof(file), "%s/%s", dir, attr);
+	f = fopen(file, "r");
+	if (!f)
+		return -1;
+	res = fscanf(f, "%u", val) == 1 ? 0 : -1;
+	fclose(f);
 
-	/* Read VID and PID */
-	memset(report_data, 0, request_size);
-	report_data[0] = 0x05;
-	report_data[1] = 0x72;
+	return res;
+}
 
-	res = hid_get_feature_report(handle, report_data, request_size);
-	if (res != request_size) {
-		fprintf(stderr, "Failed to read VID and PID\n");
-		return res;
-	}
+/* Old libusb backend paths are "bus:address:interface" in hex */
+static bool libusb_old_path(const char *path, unsigned int *bus,
+			    unsigned int *addr)
+{
+	unsigned int intf;
 
-	vid = report_data[2] << 8 | report_data[3];
-	pid = report_data[4] << 8 | report_data[5];
+	return sscanf(path, "%x:%x:%x", bus, addr, &intf) == 3;
+}
 
-	/* Read serial number */
-	res = hid_get_feature_report(handle, report_data, request_size);
-	if (res != request_size) {
-		fprintf(stderr, "Failed to read serial number\n");
-		return res;
+/* Find sysfs directory of the USB device the HID interface at path belongs to */
+static int usb_sysfs_device(const char *path, char *dir)
+{
+	char link[64];
+	unsigned int bus, addr;
+	size_t len;
+
+	/*
+	 * hidapi 0.10 and later libusb paths are "bus-port.port:config.interface",
+	 * the part before the colon names the device in sysfs
+	 */
+	len = strcspn(path, ":");
+	if (path[len] == ':' && len < 64 && memchr(path, '-', len) &&
+	    strspn(path, "0123456789-.") == len) {
+		snprintf(dir, PATH_MAX, "/sys/bus/usb/devices/%.*s", (int)len, path);
+		return read_sysfs_uint(dir, "busnum", &bus) ||
+		       read_sysfs_uint(dir, "devnum", &addr) ? -1 : 0;
 	}
-	serial_num = report_data[4] << 8 | report_data[5];
 
-	printf("VID: %.4x PID: %.4x Serial: %.4x\n", (int)vid, (int)pid, (int)serial_num);
+	if (libusb_old_path(path, &bus, &addr)) {
+		struct dirent *entry;
+		DIR *devices;
+		int res = -1;
 
-	/* Erase this area */
-	report_data[0] = 0x05; /* report id */
-	report_data[1] = 0x65;
-	report_data[2] = 0xff;
-	report_data[3] = 0x00;
-	report_data[4] = 0x00;
-	report_data[5] = 0x00;
-	res = hid_send_feature_report(handle, report_data, request_size);
-	if (res != request_size) {
-		fprintf(stderr, "Failed to send erase command\n");
-		return res;
-	}
-	usleep(200000);
+		devices = opendir("/sys/bus/usb/devices");
+		if (!devices)
+			return -1;
+		while (res && (entry = readdir(devices))) {
+			unsigned int b, a;
+
+			/* Interfaces ("1-1:1.0") have no busnum */
+			snprintf(dir, PATH_MAX, "/sys/bus/usb/devices/%.64s", entry->d_name);
+			if (!read_sysfs_uint(dir, "busnum", &b) &&
+			    !read_sysfs_uint(dir, "devnum", &a) &&
+			    b == bus && a == addr)
+				res = 0;
+		}
+		closedir(devices);
 
-	/* Write VID PID Serial number */
-	report_data[0] = 0x05; /* report id */
-	report_data[1] = 0x57;
-	report_data[2] = 0x80;
-	report_data[3] = 0xff;
-	report_data[4] = 0x08;
-	report_data[5] = 0x00;
-	res = hid_send_feature_report(handle, report_data, request_size);
-	if (res != request_size) {
-		fprintf(stderr, "Failed to send write command\n");
 		return res;
 	}
 
-	/* First VID and PID */
-	report_data[0] = 0x05; /* report id */
-	report_data[1] = 0x77;
-	report_data[2] = (vid >> 8) & 0xff;
-	report_data[3] = (vid & 0xff);
-	report_data[4] = (pid >> 8) & 0xff;
-	report_data[5] = (pid & 0xff);
-	res = hid_send_feature_report(handle, report_data, request_size);
-	if (res != request_size) {
-		fprintf(stderr, "Failed to write VID and PID\n");
-		return res;
+	/* hidraw backend, walk up from the hidraw node to the USB device */
+	if (strncmp(path, "/dev/", 5))
+		return -1;
+	snprintf(link, sizeof(link), "/sys/class/%s/device", path + 5);
+	if (!realpath(link, dir))
+		return -1;
+
+	for (;;) {
+		char *slash;
+
+		if (!read_sysfs_uint(dir, "busnum", &bus))
+			return 0;
+
+		slash = strrchr(dir, '/');
+		if (!slash || slash == dir)
+			return -1;
+		*slash = '\0';
 	}
+}
 
-	/* Then serial */
-	report_data[0] = 0x05; /* report id */
-	report_data[1] = 0x77;
-	report_data[2] = (1) & 0xff; /* m_sensor_direct */
-	report_data[3] = 0x00;
-	report_data[4] = (serial_num >> 8) & 0xff;
-	report_data[5] = (serial_num & 0xff);
-	res = hid_send_feature_report(handle, report_data, request_size);
-	if (res != request_size) {
-		fprintf(stderr, "Failed to write VID and PID\n");
-		return res;
+/* Find usbfs node of the USB device */
+static int usb_device_node(const char *path, char *node, size_t len)
+{
+	char dir[PATH_MAX];
+	unsigned int bus, addr;
+
+	/* No need to go through sysfs for old libusb paths */
+	if (!libusb_old_path(path, &bus, &addr)) {
+		if (usb_sysfs_device(path, dir) ||
+		    read_sysfs_uint(dir, "busnum", &bus) ||
+		    read_sysfs_uint(dir, "devnum", &addr))
+			return -1;
 	}
+	snprintf(node, len, "/dev/bus/usb/%03u/%03u", bus, addr);
 
 	return 0;
 }
 
-int do_write_fw(hid_device *handle, unsigned char *data, long int data_lenght)
+/* Port chain of the USB device, e.g. "1-1.4.2" */
+static int usb_port_path(const char *path, char *port, size_t len)
 {
-	unsigned char report_data[request_size];
-	unsigned char command[2050];
-	int res;
+	char dir[PATH_MAX];
 
-	report_data[0] = 0x05; /* report id */
-	report_data[1] = 0x57;
-	report_data[2] = 0x00;
-	report_data[3] = 0x00;
-	report_data[4] = data_lenght & 0xff;
-	report_data[5] = (data_lenght >> 8) & 0xff;
-	
-	res = hid_send_feature_report(handle, report_data, request_size);
-	if (res != request_size) {
-		fprintf(stderr, "Failed to send 1st write command\n");
-		return res;
-	}
+	if (usb_sysfs_device(path, dir))
+		return -1;
+	snprintf(port, len, "%s", strrchr(dir, '/') + 1);
 
-	for (int i = 0; i < data_lenght / 2048; i++)
-	{
-		memset(command, 0, sizeof(command));
-		command[0] = 0x06;
-		command[1] = 0x77;
-		memcpy(command + 2, data + i * 2048, 2048);
-		/* FIXME: why? */
-		if (i == 0)
-			command[2] = 0x00;
+	return 0;
+}
 
-		res = hid_send_feature_report(handle, command, sizeof(command));
-		if (res != sizeof(command)) {
-			fprintf(stderr, "Failed to write data\n");
-			return res;
-		}
-		usleep(10000);
-	}
+/* Port reset aborts any control transfer that is in flight */
+static int usb_reset(const char *path)
+{
+	char node[32];
+	int fd, res;
 
-	res = hid_send_feature_report(handle, report_data, request_size);
-	if (res != request_size) {
-		fprintf(stderr, "Failed to send 2nd write command\n");
-		return res;
-	}
+	if (usb_device_node(path, node, sizeof(node)))
+		return -1;
 
-	memset(command, 0, sizeof(command));
-	command[0] = 0x06;
-	command[1] = 0x77;
-	memcpy(command + 2, data, 2048);
-	res = hid_send_feature_report(handle, command, sizeof(command));
-	if (res != sizeof(command)) {
-		fprintf(stderr, "Failed to write data\n");
-		return res;
-	}
-	usleep(10000);
+	fd = open(node, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	res = ioctl(fd, USBDEVFS_RESET, 0);
+	close(fd);
 
-	return 0;
+	return res;
 }
 
-void write_fw(void)
+/* Without a reset nothing can abort a transfer, so make sure there is one */
+static int usb_reset_check(const char *path)
 {
-	unsigned char report_data[request_size];
-	long int data_lenght = 14 * 1024;
-	unsigned char data[data_lenght];
-	unsigned char read_data[data_lenght];
-	FILE *in;
-	int res;
-	ssize_t offset = 0;
-	int retries;
+	char node[32];
 
-	hid_device *handle;
-
-	in = fopen(firmware_file, "rb");
-	if (!in) {
-		fprintf(stderr, "Failed to open %s for read\n", firmware_file);
-		exit(EXIT_FAILURE);
+	if (usb_device_node(path, node, sizeof(node))) {
+		fprintf(stderr, "%s: no USB device node, --reset-on-timeout can not reset it\n",
+			path);
+		return -1;
 	}
-
-	memset(data, 0, sizeof(data));
-	while (!feof(in)) {
-		ssize_t bytes = fread(data + offset, 1, 1024, in);
-		if (!bytes)
-			break;
-		offset += bytes;
+	if (access(node, W_OK)) {
+		fprintf(stderr, "%s: --reset-on-timeout can not reset it through %s: %s\n",
+			path, node, strerror(errno));
+		return -1;
 	}
-	fclose(in);
 
-	if (offset != data_lenght) {
-		fprintf(stderr, "Short firmware: %d bytes\n", (int)offset);
+	return 0;
+}
+#else
+static int usb_device_node(const char *path, char *node, size_t len)
+{
+	return -1;
+}
+
+static int usb_port_path(const char *path, char *port, size_t len)
+{
+	return -1;
+}
+
+static int usb_reset(const char *path)
+{
+	return -1;
+}
+
+static int usb_reset_check(const char *path)
+{
+	fprintf(stderr, "--reset-on-timeout is only supported on Linux\n");
+	return -1;
+}
+#endif
+
+/*
+ * HID transfers block, so the watchdog runs in its own thread. It is
+ * armed around every report that has a deadline and, if the report does
+ * not complete in time, resets the device to abort the transfer.
+ */
+static pthread_mutex_t watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watchdog_cond;
+static struct device *watchdog_dev;
+static struct timespec watchdog_deadline;
+static bool watchdog_fired;
+
+static void *watchdog_thread(void *arg)
+{
+	pthread_mutex_lock(&watchdog_lock);
+	for (;;) {
+		if (!watchdog_dev) {
+			pthread_cond_wait(&watchdog_cond, &watchdog_lock);
+			continue;
+		}
+		if (pthread_cond_timedwait(&watchdog_cond, &watchdog_lock,
+					   &watchdog_deadline) != ETIMEDOUT ||
+		    !watchdog_dev)
+			continue;
+		/* The timeout may be of a deadline that was re-armed meanwhile */
+		if (now_us() < (uint64_t)watchdog_deadline.tv_sec * 1000000 +
+			       watchdog_deadline.tv_nsec / 1000)
+			continue;
+
+		/* The transfer is only aborted if the reset went through */
+		if (!watchdog_dev->sim && usb_reset(watchdog_dev->path))
+			fprintf(stderr, "Failed to reset %s\n", watchdog_dev->path);
+		else
+			watchdog_fired = true;
+		watchdog_dev = NULL;
+	}
+
+	return NULL;
+}
+
+static void watchdog_init(void)
+{
+	static bool started;
+	pthread_condattr_t attr;
+	pthread_t thread;
+
+	if (started)
+		return;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&watchdog_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&thread, NULL, watchdog_thread, NULL)) {
+		fprintf(stderr, "Failed to start watchdog\n");
 		exit(EXIT_FAILURE);
 	}
+	pthread_detach(thread);
+	started = true;
+}
+
+static void watchdog_arm(struct device *dev, uint64_t deadline)
+{
+	pthread_mutex_lock(&watchdog_lock);
+	watchdog_dev = dev;
+	watchdog_fired = false;
+	watchdog_deadline.tv_sec = deadline / 1000000;
+	watchdog_deadline.tv_nsec = (deadline % 1000000) * 1000;
+	pthread_cond_signal(&watchdog_cond);
+	pthread_mutex_unlock(&watchdog_lock);
+}
+
+/* Returns true if the watchdog fired since it was armed */
+static bool watchdog_disarm(void)
+{
+	bool fired;
+
+	pthread_mutex_lock(&watchdog_lock);
+	watchdog_dev = NULL;
+	fired = watchdog_fired;
+	pthread_mutex_unlock(&watchdog_lock);
+
+	return fired;
+}
+
+/*
+ * Latency of every feature report, per report id, opcode and direction.
+ * Buckets are histogram_resolution us wide, the last one collects
+ * everything slower.
+ */
+#define HISTOGRAM_BUCKETS 64
+#define HISTOGRAM_DEFAULT_RESOLUTION 500
+#define HISTOGRAM_MAX 32
+
+struct histogram {
+	unsigned char id, opcode;
+	bool get;
+	unsigned long count, failed;
+	uint64_t total_us, min_us, max_us;
+	unsigned long buckets[HISTOGRAM_BUCKETS + 1];
+};
+
+static struct histogram histograms[HISTOGRAM_MAX];
+static int nhistograms;
+
+static void histogram_add(unsigned char id, unsigned char opcode, bool get,
+			  uint64_t us, bool ok)
+{
+	struct histogram *h = NULL;
+	uint64_t bucket;
+
+	if (!histogram_resolution)
+		return;
+
+	for (int i = 0; i < nhistograms && !h; i++) {
+		if (histograms[i].id == id && histograms[i].opcode == opcode &&
+		    histograms[i].get == get)
+			h = &histograms[i];
+	}
+	if (!h) {
+		if (nhistograms == HISTOGRAM_MAX)
+			return;
+		h = &histograms[nhistograms++];
+		h->id = id;
+		h->opcode = opcode;
+		h->get = get;
+		h->min_us = UINT64_MAX;
+	}
+
+	h->count++;
+	if (!ok)
+		h->failed++;
+	h->total_us += us;
+	if (us < h->min_us)
+		h->min_us = us;
+	if (us > h->max_us)
+		h->max_us = us;
+
+	bucket = us / histogram_resolution;
+	h->buckets[bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS]++;
+}
+
+/* Upper bound of the bucket holding the given fraction of samples */
+static uint64_t histogram_percentile(const struct histogram *h, double fraction)
+{
+	unsigned long seen = 0;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= fraction * h->count) {
+			uint64_t bound = (uint64_t)(i + 1) * histogram_resolution;
+
+			return bound < h->max_us ? bound : h->max_us;
+		}
+	}
+
+	return h->max_us;
+}
+
+static void histogram_print(void)
+{
+	FILE *out;
+
+	if (!nhistograms)
+		return;
+
+	fprintf(stderr, "\nReport  Dir  Count  Failed  Min(us)  Avg(us)  P50(us)  P99(us)  Max(us)\n");
+	for (int i = 0; i < nhistograms; i++) {
+		const struct histogram *h = &histograms[i];
+
+		fprintf(stderr, "%.2x/%.2x   %s  %5lu  %6lu  %7llu  %7llu  %7llu  %7llu  %7llu\n",
+			(int)h->id, (int)h->opcode, h->get ? "get" : "set",
+			h->count, h->failed, (unsigned long long)h->min_us,
+			(unsigned long long)(h->total_us / h->count),
+			(unsigned long long)histogram_percentile(h, 0.5),
+			(unsigned long long)histogram_percentile(h, 0.99),
+			(unsigned long long)h->max_us);
+	}
+
+	if (!histogram_file)
+		return;
+
+	out = fopen(histogram_file, "w");
+	if (!out) {
+		fprintf(stderr, "Failed to open %s for write\n", histogram_file);
+		return;
+	}
+	/* One row per non-empty bucket, the last bucket has no upper bound */
+	fprintf(out, "report,opcode,direction,bucket_start_us,bucket_end_us,count\n");
+	for (int i = 0; i < nhistograms; i++) {
+		const struct histogram *h = &histograms[i];
+
+		for (int j = 0; j <= HISTOGRAM_BUCKETS; j++) {
+			if (!h->buckets[j])
+				continue;
+			fprintf(out, "0x%.2x,0x%.2x,%s,%ld,", (int)h->id,
+				(int)h->opcode, h->get ? "get" : "set",
+				j * histogram_resolution);
+			if (j < HISTOGRAM_BUCKETS)
+				fprintf(out, "%ld", (j + 1) * histogram_resolution);
+			fprintf(out, ",%lu\n", h->buckets[j]);
+		}
+	}
+	fclose(out);
+}
+
+/*
+ * Capture file: a 16 byte header, "PBTPCAP" magic, version and request
+ * size, then one record per feature report. A record is a 24 byte head
+ * followed by the report as sent, or as returned for a get. Integers
+ * are little endian:
+ *   u64 start (us since capture start)	u32 duration (us)	i32 result
+ *   u16 device	u16 length	u8 direction (0 set, 1 get)
+ *   u8 report id	u8 opcode	u8 reserved
+ */
+#define CAPTURE_MAGIC "PBTPCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 16
+#define CAPTURE_RECORD_SIZE 24
+
+struct capture_record {
+	uint64_t start;
+	uint32_t duration;
+	int32_t result;
+	uint16_t device;
+	uint16_t length;
+	bool get;
+	unsigned char id, opcode;
+};
+
+static FILE *capture;
+static uint64_t capture_start;
+
+static void put_le(unsigned char *p, uint64_t val, int n)
+{
+	for (int i = 0; i < n; i++)
+		p[i] = (val >> (8 * i)) & 0xff;
+}
+
+static uint64_t get_le(const unsigned char *p, int n)
+{
+	uint64_t val = 0;
+
+	for (int i = n - 1; i >= 0; i--)
+		val = (val << 8) | p[i];
+
+	return val;
+}
+
+static void capture_close(void)
+{
+	if (capture && fclose(capture))
+		fprintf(stderr, "Failed to write %s\n", capture_file);
+	capture = NULL;
+}
+
+static int capture_open(void)
+{
+	unsigned char header[CAPTURE_HEADER_SIZE] = CAPTURE_MAGIC;
+
+	capture = fopen(capture_file, "wb");
+	if (!capture) {
+		fprintf(stderr, "Failed to open %s for write\n", capture_file);
+		return -1;
+	}
+	put_le(header + 8, CAPTURE_VERSION, 4);
+	put_le(header + 12, request_size, 4);
+	fwrite(header, 1, sizeof(header), capture);
+	capture_start = now_us();
+	/* Flushed however we exit */
+	atexit(capture_close);
+
+	return 0;
+}
+
+static void capture_report(const struct device *dev, bool get,
+			   unsigned char opcode, const unsigned char *data,
+			   size_t len, int res, uint64_t start)
+{
+	unsigned char head[CAPTURE_RECORD_SIZE];
+
+	if (!capture)
+		return;
+
+	put_le(head, start - capture_start, 8);
+	put_le(head + 8, now_us() - start, 4);
+	put_le(head + 12, (uint32_t)res, 4);
+	put_le(head + 16, dev->index, 2);
+	put_le(head + 18, len, 2);
+	head[20] = get;
+	head[21] = data[0];
+	head[22] = opcode;
+	head[23] = 0;
+	fwrite(head, 1, sizeof(head), capture);
+	fwrite(data, 1, len, capture);
+}
+
+/* Returns 1 at the end of the capture, -1 if it is truncated */
+static int capture_read(FILE *in, struct capture_record *rec,
+			unsigned char *data, size_t size)
+{
+	unsigned char head[CAPTURE_RECORD_SIZE];
+	size_t n = fread(head, 1, sizeof(head), in);
+
+	if (!n)
+		return 1;
+	if (n != sizeof(head))
+		return -1;
+
+	rec->start = get_le(head, 8);
+	rec->duration = get_le(head + 8, 4);
+	rec->result = (int32_t)get_le(head + 12, 4);
+	rec->device = get_le(head + 16, 2);
+	rec->length = get_le(head + 18, 2);
+	rec->get = head[20];
+	rec->id = head[21];
+	rec->opcode = head[22];
+
+	if (rec->length < 2 || rec->length > size ||
+	    fread(data, 1, rec->length, in) != rec->length)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Traceability log, one JSON line per operation on a device, appended to
+ * trace_file. Records are queued and a thread writes whatever piled up
+ * with one write() and fdatasync(), so a cycle never waits for the disk
+ * and syncs are batched however fast units come.
+ */
+static int trace_fd = -1;
+static pthread_t trace_thread;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+static char *trace_queue;
+static size_t trace_len, trace_size;
+static bool trace_stop;
+
+static void *trace_writer(void *arg)
+{
+	char *buf = NULL, *tmp;
+	size_t size = 0, len;
+
+	pthread_mutex_lock(&trace_lock);
+	for (;;) {
+		while (!trace_len && !trace_stop)
+			pthread_cond_wait(&trace_cond, &trace_lock);
+		if (!trace_len)
+			break;
+
+		/* Take the queue, new records go to the other buffer */
+		tmp = buf;
+		buf = trace_queue;
+		trace_queue = tmp;
+		len = size;
+		size = trace_size;
+		trace_size = len;
+		len = trace_len;
+		trace_len = 0;
+		pthread_mutex_unlock(&trace_lock);
+
+		if (write(trace_fd, buf, len) != len || fdatasync(trace_fd))
+			fprintf(stderr, "Failed to write %s: %s\n", trace_file,
+				strerror(errno));
+
+		pthread_mutex_lock(&trace_lock);
+	}
+	pthread_mutex_unlock(&trace_lock);
+	free(buf);
+
+	return NULL;
+}
+
+/* Waits for queued records to reach the disk */
+static void trace_close(void)
+{
+	if (trace_fd < 0)
+		return;
+
+	pthread_mutex_lock(&trace_lock);
+	trace_stop = true;
+	pthread_cond_signal(&trace_cond);
+	pthread_mutex_unlock(&trace_lock);
+	pthread_join(trace_thread, NULL);
+
+	close(trace_fd);
+	trace_fd = -1;
+	free(trace_queue);
+}
+
+static int trace_open(void)
+{
+	trace_fd = open(trace_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (trace_fd < 0) {
+		fprintf(stderr, "Failed to open %s for write: %s\n", trace_file,
+			strerror(errno));
+		return -1;
+	}
+	pthread_create(&trace_thread, NULL, trace_writer, NULL);
+	atexit(trace_close);
+
+	return 0;
+}
+
+/* Called with trace_lock held */
+static void trace_append(const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	if (trace_len + len + 1 > trace_size) {
+		trace_size = (trace_len + len + 1) * 2;
+		trace_queue = realloc(trace_queue, trace_size);
+	}
+	va_start(ap, fmt);
+	vsnprintf(trace_queue + trace_len, len + 1, fmt, ap);
+	va_end(ap);
+	trace_len += len;
+}
+
+/* Time in the current step since it began or since the last record */
+static void phase_account(struct device *dev, uint64_t now)
+{
+	uint64_t start = dev->phase_start > dev->trace_start ?
+			 dev->phase_start : dev->trace_start;
+	int i;
+
+	if (!dev->phase)
+		return;
+	for (i = 0; i < dev->nphase_times; i++) {
+		if (!strcmp(dev->phase_times[i].name, dev->phase))
+			break;
+	}
+	if (i == sizeof(dev->phase_times) / sizeof(dev->phase_times[0]))
+		return;
+	if (i == dev->nphase_times) {
+		dev->phase_times[i].name = dev->phase;
+		dev->phase_times[i].us = 0;
+		dev->nphase_times++;
+	}
+	dev->phase_times[i].us += now - start;
+}
+
+/* Record how the operation went, then start timing the next one */
+static void trace_record(struct device *dev, const char *op, int status)
+{
+	uint64_t now = now_us();
+	char stamp[32];
+	time_t t;
+
+	if (trace_fd < 0)
+		return;
+
+	phase_account(dev, now);
+	t = time(NULL);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+
+	pthread_mutex_lock(&trace_lock);
+	trace_append("{\"time\":\"%s\",\"op\":\"%s\",\"device\":\"", stamp, op);
+	for (const char *p = dev->path; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			trace_append("\\%c", *p);
+		else if ((unsigned char)*p < 0x20)
+			trace_append("\\u%04x", *p);
+		else
+			trace_append("%c", *p);
+	}
+	trace_append("\",\"port\":\"%s\"", dev->port);
+	if (dev->have_record)
+		trace_append(",\"vid\":\"%.2x%.2x\",\"pid\":\"%.2x%.2x\",\"serial\":\"%.2x%.2x\"",
+			     dev->record[0], dev->record[1], dev->record[2],
+			     dev->record[3], dev->record[6], dev->record[7]);
+	if (dev->image_crc)
+		trace_append(",\"image_crc\":\"%08x\"", dev->image_crc);
+	trace_append(",\"status\":%d,\"ms\":%.1f,\"phases_ms\":{", status,
+		     (now - (dev->trace_start ? dev->trace_start : dev->opened)) / 1000.0);
+	for (int i = 0; i < dev->nphase_times; i++)
+		trace_append("%s\"%s\":%.1f", i ? "," : "",
+			     dev->phase_times[i].name,
+			     dev->phase_times[i].us / 1000.0);
+	trace_append("},\"retries\":%lu,\"recovery_ms\":%.1f,\"failed_reports\":%lu,\"short_reports\":%lu}\n",
+		     dev->retries - dev->trace_base.retries,
+		     (dev->recovery_us - dev->trace_base.recovery_us) / 1000.0,
+		     dev->failed_reports - dev->trace_base.failed_reports,
+		     dev->short_reports - dev->trace_base.short_reports);
+	pthread_cond_signal(&trace_cond);
+	pthread_mutex_unlock(&trace_lock);
+
+	dev->trace_start = now;
+	dev->nphase_times = 0;
+	dev->trace_base.retries = dev->retries;
+	dev->trace_base.recovery_us = dev->recovery_us;
+	dev->trace_base.failed_reports = dev->failed_reports;
+	dev->trace_base.short_reports = dev->short_reports;
+}
+
+/*
+ * Timing cache, one line per USB port and controller release:
+ *   port release pacing_us serial_erase_us
+ * written by --calibrate and looked up whenever a device is opened.
+ */
+static void timing_key(const struct device *dev, char *key, size_t len)
+{
+	char port[32];
+
+	if (usb_port_path(dev->path, port, sizeof(port)))
+		snprintf(port, sizeof(port), "%s", dev->path);
+	snprintf(key, len, "%s 0x%04x", port, (int)dev->release);
+}
+
+/* Start from the defaults, then use the calibrated timing if there is one */
+static void timing_load(struct device *dev)
+{
+	char key[64], line[128];
+	long int pacing, erase;
+	FILE *in;
+
+	dev->pacing_us = REPORT_PACING_US;
+	dev->serial_erase_us = SERIAL_ERASE_US;
+	if (!timing_cache)
+		return;
+
+	in = fopen(timing_cache, "r");
+	if (!in)
+		return;
+
+	timing_key(dev, key, sizeof(key));
+	while (fgets(line, sizeof(line), in)) {
+		size_t n = strlen(key);
+
+		if (strncmp(line, key, n) || line[n] != ' ' ||
+		    sscanf(line + n, "%ld %ld", &pacing, &erase) != 2 ||
+		    pacing <= 0 || erase <= 0)
+			continue;
+
+		dev->pacing_us = pacing;
+		dev->serial_erase_us = erase;
+		printf("%s: calibrated pacing %ld us, serial erase wait %ld us\n",
+		       dev->path, pacing, erase);
+		break;
+	}
+	fclose(in);
+}
+
+static int timing_save(const struct device *dev)
+{
+	struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	char key[64], line[128];
+	char *lines = NULL;
+	size_t size = 0;
+	FILE *f;
+	int fd, res = -1;
+
+	fd = open(timing_cache, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || !(f = fdopen(fd, "r+"))) {
+		fprintf(stderr, "Failed to open %s: %s\n", timing_cache,
+			strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	/* Released by fclose() */
+	if (fcntl(fd, F_SETLKW, &lock)) {
+		fprintf(stderr, "Failed to lock %s: %s\n", timing_cache,
+			strerror(errno));
+		goto err_out;
+	}
+
+	/* Keep the other ports, replace this one */
+	timing_key(dev, key, sizeof(key));
+	while (fgets(line, sizeof(line), f)) {
+		size_t n = strlen(key), len = strlen(line);
+
+		if (!strncmp(line, key, n) && line[n] == ' ')
+			continue;
+		lines = realloc(lines, size + len);
+		memcpy(lines + size, line, len);
+		size += len;
+	}
+
+	rewind(f);
+	if (size)
+		fwrite(lines, 1, size, f);
+	fprintf(f, "%s %ld %ld\n", key, dev->pacing_us, dev->serial_erase_us);
+	if (fflush(f) || ftruncate(fd, ftell(f)) || fsync(fd)) {
+		fprintf(stderr, "Failed to write %s: %s\n", timing_cache,
+			strerror(errno));
+		goto err_out;
+	}
+	res = 0;
+
+err_out:
+	free(lines);
+	fclose(f);
+	return res;
+}
+
+/* Simulated devices get their own fault seed so they fail differently */
+static int sim_open(struct device *dev, int index)
+{
+	struct sim_faults faults = sim_faults;
+	char path[16];
+
+	faults.seed += index;
+	dev->sim = malloc(sizeof(*dev->sim));
+	if (!dev->sim)
+		return -1;
+	sim_init(dev->sim, request_size, &sim_timing, &faults);
+
+	snprintf(path, sizeof(path), "sim%d", index);
+	dev->index = index;
+	dev->path = strdup(path);
+	dev->opened = now_us();
+	dev->tier = -1;
+	dev->lock_fd = -1;
+	timing_load(dev);
+
+	return 0;
+}
+
+/*
+ * Advisory lock per USB port, so writers started by independent schedulers
+ * never talk to one device at the same time. Taken before the device is
+ * opened and held until it is closed, across resets and re-enumeration.
+ */
+static int device_lock(struct device *dev)
+{
+#define LOCK_POLL_US 100000
+	struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	uint64_t deadline = now_us() + lock_wait * 1000;
+	char file[PATH_MAX], key[64];
+	bool waiting = false;
+	int fd;
+
+	/* Without a port, the path with anything odd in it replaced */
+	snprintf(key, sizeof(key), "%s", dev->port[0] ? dev->port : dev->path);
+	for (char *p = key; *p; p++) {
+		if (!isalnum((unsigned char)*p) && *p != '-' && *p != '.')
+			*p = '_';
+	}
+	snprintf(file, sizeof(file), "%s/pbtp-%s.lock", lock_dir, key);
+
+	fd = open(file, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open lock file %s: %s\n", file,
+			strerror(errno));
+		return -1;
+	}
+
+	while (fcntl(fd, F_SETLK, &lock)) {
+		struct flock owner = lock;
+
+		if (errno != EACCES && errno != EAGAIN) {
+			fprintf(stderr, "Failed to lock %s: %s\n", file,
+				strerror(errno));
+			close(fd);
+			return -1;
+		}
+		if (now_us() >= deadline) {
+			if (!fcntl(fd, F_GETLK, &owner) && owner.l_type != F_UNLCK)
+				fprintf(stderr, "%s is in use by process %d\n",
+					dev->path, (int)owner.l_pid);
+			else
+				fprintf(stderr, "%s is in use\n", dev->path);
+			close(fd);
+			return -EBUSY;
+		}
+		if (!waiting) {
+			printf("%s is in use, waiting up to %ld ms\n", dev->path,
+			       lock_wait);
+			waiting = true;
+		}
+		usleep(LOCK_POLL_US);
+	}
+	dev->lock_fd = fd;
+
+	return 0;
+}
+
+/*
+ * Open the first interface of the device, or the one --device names by
+ * path or USB port, and remember its path
+ */
+static int open_device(struct device *dev)
+{
+	struct hid_device_info *devs, *cur;
+	char port[32];
+	int res = -1;
+
+	memset(dev, 0, sizeof(*dev));
+	if (simulate)
+		return sim_open(dev, 0);
+
+	dev->lock_fd = -1;
+	devs = hid_enumerate(USB_DEVICE_VID, USB_DEVICE_PID);
+	for (cur = devs; cur && device_select; cur = cur->next) {
+		if (!strcmp(cur->path, device_select) ||
+		    (cur->interface_number <= 0 &&
+		     !usb_port_path(cur->path, port, sizeof(port)) &&
+		     !strcmp(port, device_select)))
+			break;
+	}
+	if (device_select && !cur)
+		fprintf(stderr, "No touchpad at %s\n", device_select);
+	if (cur) {
+		dev->path = strdup(cur->path);
+		dev->release = cur->release_number;
+		usb_port_path(dev->path, dev->port, sizeof(dev->port));
+		res = device_lock(dev);
+		if (!res && reset_on_timeout)
+			res = usb_reset_check(dev->path);
+		if (!res)
+			dev->hid = hid_open_path(dev->path);
+	}
+	hid_free_enumeration(devs);
+
+	if (!dev->hid) {
+		if (dev->lock_fd >= 0)
+			close(dev->lock_fd);
+		free(dev->path);
+		dev->path = NULL;
+		return res == -EBUSY ? res : -1;
+	}
+	dev->opened = now_us();
+	dev->tier = -1;
+	timing_load(dev);
+
+	if (reset_on_timeout)
+		watchdog_init();
+
+	return 0;
+}
+
+static const char *const tier_names[] = { "retry", "reset", "restart" };
+
+/* What the session cost, and how much of it went into recovering from failures */
+static void device_stats(const struct device *dev)
+{
+	if (!dev->sim && !dev->recovery_bytes)
+		return;
+
+	fprintf(stderr, "%s: %.1f ms, %llu bytes, recovery took %.1f ms and %llu extra bytes",
+		dev->path, (now_us() - dev->opened) / 1000.0,
+		(unsigned long long)dev->bytes, dev->recovery_us / 1000.0,
+		(unsigned long long)dev->recovery_bytes);
+	if (dev->sim)
+		fprintf(stderr, ", %lu of %lu reports faulted",
+			dev->sim->faults_injected, dev->sim->reports);
+	for (int i = 0; i < 3; i++) {
+		if (dev->tier_count[i])
+			fprintf(stderr, ", %lu %s took %.1f ms", dev->tier_count[i],
+				tier_names[i], dev->tier_us[i] / 1000.0);
+	}
+	fprintf(stderr, "\n");
+}
+
+static void close_device(struct device *dev)
+{
+	if (dev->path)
+		device_stats(dev);
+	if (dev->hid)
+		hid_close(dev->hid);
+	dev->hid = NULL;
+	free(dev->sim);
+	dev->sim = NULL;
+	free(dev->path);
+	dev->path = NULL;
+	if (dev->lock_fd >= 0)
+		close(dev->lock_fd);
+	dev->lock_fd = -1;
+}
+
+/* Follow the device to a new path if it re-enumerated on the same port */
+static void find_by_port(struct device *dev)
+{
+	struct hid_device_info *devs, *cur;
+	char port[32];
+
+	devs = hid_enumerate(USB_DEVICE_VID, USB_DEVICE_PID);
+	for (cur = devs; cur; cur = cur->next) {
+		if (cur->interface_number > 0 ||
+		    usb_port_path(cur->path, port, sizeof(port)) ||
+		    strcmp(port, dev->port))
+			continue;
+		if (strcmp(cur->path, dev->path)) {
+			free(dev->path);
+			dev->path = strdup(cur->path);
+		}
+		break;
+	}
+	hid_free_enumeration(devs);
+}
+
+/* Give the device time to settle after a reset and open it again */
+static int reopen_device(struct device *dev)
+{
+#define REOPEN_TIMEOUT_US 2000000
+	uint64_t start = now_us();
+
+	/* A simulated device has nothing to re-enumerate */
+	if (dev->sim)
+		return 0;
+
+	if (dev->hid)
+		hid_close(dev->hid);
+
+	do {
+		usleep(50000);
+		if (dev->port[0])
+			find_by_port(dev);
+		dev->hid = hid_open_path(dev->path);
+		if (dev->hid)
+			return 0;
+	} while (now_us() - start < REOPEN_TIMEOUT_US);
+
+	fprintf(stderr, "Failed to re-open %s\n", dev->path);
+	return -1;
+}
+
+/* Every attempt of a step gets its own deadline */
+static void phase_begin(struct device *dev, const char *name)
+{
+	uint64_t now = now_us();
+
+	DTRACE_PROBE2(pbtp, phase_begin, dev->path, name);
+	phase_account(dev, now);
+	dev->phase = name;
+	dev->phase_start = now;
+	dev->phase_bytes = dev->bytes;
+	dev->phase_deadline = phase_timeout ? dev->phase_start + phase_timeout * 1000 : 0;
+}
+
+/* Whatever a failed attempt took has to be spent again by the retry */
+static void phase_failed(struct device *dev)
+{
+	DTRACE_PROBE2(pbtp, phase_failed, dev->path, dev->phase);
+	dev->retries++;
+	dev->recovery_us += now_us() - dev->phase_start;
+	dev->recovery_bytes += dev->bytes - dev->phase_bytes;
+}
+
+/*
+ * Deadline of a single report, or 0 if there is none. Fails the report
+ * right away if its phase is already over.
+ */
+static int report_deadline(struct device *dev, uint64_t *deadline)
+{
+	uint64_t now = now_us();
+
+	*deadline = report_timeout ? now + report_timeout * 1000 : 0;
+	if (!dev->phase_deadline)
+		return 0;
+
+	if (now >= dev->phase_deadline) {
+		fprintf(stderr, "Phase %s timed out after %ld ms\n", dev->phase,
+			phase_timeout);
+		return -1;
+	}
+	if (!*deadline || dev->phase_deadline < *deadline)
+		*deadline = dev->phase_deadline;
+
+	return 0;
+}
+
+/*
+ * Reports that miss their deadline are failed so that the retry loops
+ * take over. With reset_on_timeout the transfer is aborted on expiry
+ * instead of waiting for the kernel or libusb to give up on it.
+ */
+static int finish_report(struct device *dev, int res, uint64_t deadline,
+			 unsigned char id, unsigned char opcode)
+{
+	bool fired = false;
+
+	if (!deadline)
+		return res;
+
+	if (reset_on_timeout)
+		fired = watchdog_disarm();
+
+	if (!fired && now_us() < deadline)
+		return res;
+
+	fprintf(stderr, "Report %.2x/%.2x missed its deadline%s\n", (int)id,
+		(int)opcode, fired ? ", device was reset" : "");
+	if (fired)
+		reopen_device(dev);
+
+	return -1;
+}
+
+/* Firmware block a 0x06 report transfers, -1 for 0x05 reports */
+#define REPORT_BLOCK(dev, id) ((id) == 0x06 ? (int)((dev)->addr / BLOCK_SIZE) : -1)
+
+/* Follow the address that 0x52 and 0x57 set and 0x06 reports advance */
+static void report_advance(struct device *dev, const unsigned char *data,
+			   size_t len, int res)
+{
+	if (data[0] == 0x05 && (data[1] == 0x52 || data[1] == 0x57))
+		dev->addr = data[2] | (data[3] << 8);
+	else if (data[0] == 0x06 && res == len)
+		dev->addr += len - 2;
+}
+
+static int send_report(struct device *dev, const unsigned char *data, size_t len)
+{
+	uint64_t deadline, start;
+	int res;
+
+	if ((!dev->hid && !dev->sim) || report_deadline(dev, &deadline))
+		return -1;
+
+	if (deadline && reset_on_timeout)
+		watchdog_arm(dev, deadline);
+	DTRACE_PROBE4(pbtp, send_start, data[0], data[1],
+		      REPORT_BLOCK(dev, data[0]), len);
+	start = now_us();
+	if (dev->sim)
+		res = sim_send_feature_report(dev->sim, data, len);
+	else
+		res = hid_send_feature_report(dev->hid, data, len);
+	DTRACE_PROBE5(pbtp, send_done, data[0], data[1],
+		      REPORT_BLOCK(dev, data[0]), len, res);
+	report_advance(dev, data, len, res);
+	dev->last_report = now_us();
+	dev->bytes += len;
+	if (res < 0)
+		dev->failed_reports++;
+	else if (res != len)
+		dev->short_reports++;
+	histogram_add(data[0], data[1], false, now_us() - start, res == len);
+	capture_report(dev, false, data[1], data, len, res, start);
+
+	return finish_report(dev, res, deadline, data[0], data[1]);
+}
+
+/* Opcode is not sent with a get, but callers set it for reference */
+static int get_report(struct device *dev, unsigned char *data, size_t len)
+{
+	unsigned char id = data[0], opcode = data[1];
+	uint64_t deadline, start;
+	int res;
+
+	if ((!dev->hid && !dev->sim) || report_deadline(dev, &deadline))
+		return -1;
+
+	if (deadline && reset_on_timeout)
+		watchdog_arm(dev, deadline);
+	DTRACE_PROBE4(pbtp, get_start, id, opcode, REPORT_BLOCK(dev, id), len);
+	start = now_us();
+	if (dev->sim)
+		res = sim_get_feature_report(dev->sim, data, len);
+	else
+		res = hid_get_feature_report(dev->hid, data, len);
+	DTRACE_PROBE5(pbtp, get_done, id, opcode, REPORT_BLOCK(dev, id), len,
+		      res);
+	if (id == 0x06 && res == len)
+		dev->addr += len - 2;
+	dev->last_report = now_us();
+	dev->bytes += len;
+	if (res < 0)
+		dev->failed_reports++;
+	else if (res != len)
+		dev->short_reports++;
+	histogram_add(id, opcode, true, now_us() - start, res == len);
+	capture_report(dev, true, opcode, data, len, res, start);
+
+	return finish_report(dev, res, deadline, id, opcode);
+}
+
+/* Give the device time to program, counted from when the last report completed */
+static void pace(const struct device *dev)
+{
+	sleep_until(dev->last_report + dev->pacing_us);
+}
+
+static uint32_t crc32(const unsigned char *data, long int data_lenght)
+{
+	uint32_t crc = 0xffffffff;
+
+	for (long int i = 0; i < data_lenght; i++) {
+		crc ^= data[i];
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+static void set_header(unsigned char *report, unsigned char opcode,
+		       long int addr, long int len)
+{
+	memset(report, 0, request_size);
+	report[0] = 0x05; /* report id */
+	report[1] = opcode;
+	report[2] = addr & 0xff;
+	report[3] = (addr >> 8) & 0xff;
+	report[4] = len & 0xff;
+	report[5] = (len >> 8) & 0xff;
+}
+
+/*
+ * Frames for the first pass have block 0 with its first byte cleared, it
+ * is completed by the commit frame after all other blocks are written.
+ */
+struct flash_plan *plan_build(const unsigned char *data, long int data_lenght)
+{
+	struct flash_plan *plan;
+
+	plan = calloc(1, sizeof(*plan));
+	plan->length = data_lenght;
+	plan->nblocks = data_lenght / BLOCK_SIZE;
+	plan->crc = crc32(data, data_lenght);
+
+	plan->image = malloc(data_lenght);
+	memcpy(plan->image, data, data_lenght);
+
+	plan->read_header = malloc(request_size);
+	set_header(plan->read_header, 0x52, 0, data_lenght);
+
+	plan->write_headers = malloc(plan->nblocks * sizeof(*plan->write_headers));
+	plan->frames = malloc(plan->nblocks * sizeof(*plan->frames));
+	for (int i = 0; i < plan->nblocks; i++) {
+		long int offset = i * BLOCK_SIZE;
+
+		plan->write_headers[i] = malloc(request_size);
+		set_header(plan->write_headers[i], 0x57, offset, data_lenght - offset);
+
+		plan->frames[i][0] = 0x06;
+		plan->frames[i][1] = 0x77;
+		memcpy(plan->frames[i] + 2, data + offset, BLOCK_SIZE);
+	}
+	/* FIXME: why? */
+	plan->frames[0][2] = 0x00;
+
+	plan->commit_frame[0] = 0x06;
+	plan->commit_frame[1] = 0x77;
+	memcpy(plan->commit_frame + 2, data, BLOCK_SIZE);
+
+	return plan;
+}
+
+void plan_free(struct flash_plan *plan)
+{
+	if (!plan)
+		return;
+
+	for (int i = 0; i < plan->nblocks; i++)
+		free(plan->write_headers[i]);
+	free(plan->write_headers);
+	free(plan->frames);
+	free(plan->read_header);
+	free(plan->image);
+	free(plan);
+}
+
+/* What block i reads back as, before or after the commit frame */
+static const unsigned char *plan_expected(const struct flash_plan *plan, int i,
+					  bool committed)
+{
+	if (i == 0 && !committed)
+		return plan->frames[0] + 2;
+
+	return plan->image + i * BLOCK_SIZE;
+}
+
+/*
+ * Journal is a text file with one record per line:
+ *   image <crc32> <length>	image being written
+ *   erase			pages 0-6 were erased
+ *   block <n>			block n was sent
+ *   done			block 0 was rewritten, image is complete
+ * Every record is synced to disk before the next report is sent.
+ */
+static void journal_record(const char *fmt, ...)
+{
+	char line[64];
+	va_list ap;
+	int len;
+
+	if (journal_fd < 0)
+		return;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+
+	if (write(journal_fd, line, len) != len || fsync(journal_fd))
+		fprintf(stderr, "Failed to update journal %s: %s\n",
+			journal_file, strerror(errno));
+}
+
+static int journal_open(void)
+{
+	journal_fd = open(journal_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (journal_fd < 0) {
+		fprintf(stderr, "Failed to open journal %s: %s\n",
+			journal_file, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void journal_start(const struct flash_plan *plan)
+{
+	if (journal_fd < 0)
+		return;
+
+	if (ftruncate(journal_fd, 0))
+		fprintf(stderr, "Failed to truncate journal %s\n", journal_file);
+	journal_record("image %08x %ld\n", plan->crc, plan->length);
+}
+
+/* Journal is removed once the device is fully programmed */
+static void journal_close(bool complete)
+{
+	if (journal_fd < 0)
+		return;
+
+	close(journal_fd);
+	journal_fd = -1;
+	if (complete)
+		unlink(journal_file);
+}
+
+int do_read_range(struct device *dev, long int addr, unsigned char *data,
+		  long int data_lenght)
+{
+#define READ_BLOCK_SIZE 2048
+	unsigned char report_data[request_size];
+	unsigned char command[READ_BLOCK_SIZE + 2];
+	int res;
+
+	report_data[0] = 0x05; /* report id */
+	report_data[1] = 0x52;
+	report_data[2] = addr & 0xff;
+	report_data[3] = (addr >> 8) & 0xff;
+	report_data[4] = data_lenght & 0xff;
+	report_data[5] = (data_lenght >> 8) & 0xff;
+	
+	res = send_report(dev, report_data, request_size);
+	if (res != request_size) {
+		fprintf(stderr, "Failed to send read command\n");
+		return res;
+	}
+
+	for (int i = 0; i < data_lenght / READ_BLOCK_SIZE; i++)
+	{
+		memset(command, 0, sizeof(command));
+		command[0] = 0x06;
+		command[1] = 0x72;
+
+		res = get_report(dev, command, sizeof(command));
+		if (res != sizeof(command)) {
+			fprintf(stderr, "Failed to read back data: %d\n", res);
+			return res;
+		}
+		pace(dev);
+		memcpy(data + i * READ_BLOCK_SIZE, command + 2, READ_BLOCK_SIZE);
+	}
+
+	return 0;
+}
+
+int do_read_fw(struct device *dev, unsigned char *data, long int data_lenght)
+{
+	return do_read_range(dev, 0, data, data_lenght);
+}
+
+/* Resume point of a write whose blocks all went out but not the commit frame */
+#define RESUME_COMMIT -1
+
+/*
+ * Returns the first block that still has to be written, RESUME_COMMIT if
+ * only the commit frame is missing, plan->nblocks if the journal recorded
+ * the write as done, or 0 if the journal does not match the image or the
+ * device and flashing has to start over.
+ */
+static int journal_resume(struct device *dev, const struct flash_plan *plan)
+{
+	unsigned char read_data[plan->length];
+	uint32_t blocks = 0;
+	unsigned int crc = 0;
+	long int length = 0;
+	bool erased = false, done = false;
+	char line[64];
+	int first_block, checked;
+	FILE *in;
+
+	in = fopen(journal_file, "r");
+	if (!in)
+		return 0;
+
+	while (fgets(line, sizeof(line), in)) {
+		int block;
+
+		if (sscanf(line, "image %x %ld", &crc, &length) == 2)
+			continue;
+		if (!strcmp(line, "erase\n"))
+			erased = true;
+		else if (!strcmp(line, "done\n"))
+			done = true;
+		else if (sscanf(line, "block %d", &block) == 1 &&
+			 block >= 0 && block < 32)
+			blocks |= 1u << block;
+	}
+	fclose(in);
+
+	if (length != plan->length || crc != plan->crc) {
+		fprintf(stderr, "Journal %s is for another image, starting over\n",
+			journal_file);
+		return 0;
+	}
+
+	if (!erased)
+		return 0;
+
+	if (done) {
+		first_block = plan->nblocks;
+	} else {
+		for (first_block = 0; first_block < plan->nblocks &&
+		     blocks & (1u << first_block); first_block++)
+			;
+	}
+	if (!first_block)
+		return 0;
+	checked = first_block;
+	if (!done && first_block == plan->nblocks)
+		first_block = RESUME_COMMIT;
+
+	/* Make sure blocks recorded as written actually made it to the flash */
+	if (do_read_fw(dev, read_data, checked * BLOCK_SIZE))
+		goto mismatch;
+	for (int i = 0; i < checked; i++) {
+		if (memcmp(plan_expected(plan, i, done),
+			   read_data + i * BLOCK_SIZE, BLOCK_SIZE))
+			goto mismatch;
+	}
+
+	return first_block;
+
+mismatch:
+	fprintf(stderr, "Device does not match journal %s, starting over\n",
+		journal_file);
+	return 0;
+}
+
+int save_image(const char *file, const unsigned char *data, long int data_lenght)
+{
+	char path[PATH_MAX];
+	FILE *out = NULL;
+	int fd;
+
+	/* Daemon clients may only name a new file in --output-dir */
+	if (daemon_socket) {
+		if (!output_dir) {
+			fprintf(stderr, "Saving files needs --output-dir\n");
+			return -1;
+		}
+		if (!file[0] || strchr(file, '/')) {
+			fprintf(stderr, "Not a file name: %s\n", file);
+			return -1;
+		}
+		snprintf(path, sizeof(path), "%s/%s", output_dir, file);
+		file = path;
+		fd = open(file, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+		if (fd >= 0) {
+			out = fdopen(fd, "wb");
+			if (!out)
+				close(fd);
+		}
+	} else {
+		out = fopen(file, "wb");
+	}
+	if (!out) {
+		fprintf(stderr, "Failed to open %s for write\n", file);
+		return -1;
+	}
+
+	if (fwrite(data, 1, data_lenght, out) != data_lenght) {
+		fprintf(stderr, "Failed to write %s\n", file);
+		fclose(out);
+		return -1;
+	}
+
+	if (fclose(out)) {
+		fprintf(stderr, "Failed to write %s\n", file);
+		return -1;
+	}
+
+	return 0;
+}
+
+void read_fw(void)
+{
+	const long int data_lenght = FIRMWARE_SIZE;
+	unsigned char read_data[data_lenght];
+	int res;
+
+	struct device dev;
+
+	res = open_device(&dev);
+	if (res) {
+		fprintf(stderr, "Failed to open device\n");
+		exit(res == -EBUSY ? EXIT_BUSY : EXIT_FAILURE);
+	}
+
+	phase_begin(&dev, "read");
+	res = do_read_fw(&dev, read_data, data_lenght);
+	trace_record(&dev, "read", res ? EXIT_FAILURE : 0);
+	close_device(&dev);
+	if (res) {
+		fprintf(stderr, "Failed to read data\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (save_image(firmware_file, read_data, data_lenght))
+		exit(EXIT_FAILURE);
+}
+
+static volatile sig_atomic_t soak_stop;
+
+static void soak_signal(int sig)
+{
+	soak_stop = 1;
+}
+
+/*
+ * Read the firmware over and over on one open handle to qualify cables
+ * and hubs. Every good readback has to match the first one.
+ */
+int soak(void)
+{
+#define SOAK_PROGRESS_US 10000000
+	const long int data_lenght = FIRMWARE_SIZE;
+	unsigned char read_data[data_lenght];
+	unsigned long iterations = 0, failed = 0, mismatched = 0;
+	uint64_t start, elapsed, progress;
+	uint32_t first_crc = 0, crc;
+	struct sigaction sa;
+	struct device dev;
+	int res;
+
+	res = open_device(&dev);
+	if (res) {
+		fprintf(stderr, "Failed to open device\n");
+		return res == -EBUSY ? EXIT_BUSY : EXIT_NO_DEVICE;
+	}
+
+	/* Stop after the current readback on CTRL+C and still report */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = soak_signal;
+	sigaction(SIGINT, &sa, NULL);
+
+	start = progress = now_us();
+	while (!soak_stop) {
+		elapsed = now_us() - start;
+		if (soak_count ? iterations == soak_count :
+		    elapsed >= soak_seconds * 1000000ULL)
+			break;
+
+		iterations++;
+		phase_begin(&dev, "soak");
+		if (do_read_fw(&dev, read_data, data_lenght)) {
+			failed++;
+			continue;
+		}
+
+		crc = crc32(read_data, data_lenght);
+		if (iterations - failed == 1)
+			first_crc = crc;
+		else if (crc != first_crc) {
+			fprintf(stderr, "Readback %lu differs: CRC %08x, first was %08x\n",
+				iterations, crc, first_crc);
+			mismatched++;
+		}
+
+		if (now_us() - progress >= SOAK_PROGRESS_US) {
+			progress = now_us();
+			printf("%lu readbacks, %lu failed\n", iterations, failed);
+			fflush(stdout);
+		}
+	}
+	elapsed = now_us() - start;
+
+	printf("Soak: %lu readbacks in %.1f s, %lu failed, %lu inconsistent\n",
+	       iterations, elapsed / 1000000.0, failed, mismatched);
+	printf("Throughput: %.0f bytes/s of firmware data\n",
+	       elapsed ? (iterations - failed) * data_lenght * 1e6 / elapsed : 0);
+	printf("Reports: %lu short, %lu failed\n", dev.short_reports,
+	       dev.failed_reports);
+	close_device(&dev);
+
+	return failed || mismatched ? EXIT_FAILURE : 0;
+}
+
+/* Read the 8 byte VID, PID and serial number record at 0xff80 */
+int do_read_serial_area(struct device *dev, unsigned char *record)
+{
+	unsigned char report_data[request_size];
+	int res;
+
+	/* Set address and lenght */
+	report_data[0] = 0x05; /* report id */
+	report_data[1] = 0x52;
+	report_data[2] = 0x80;
+	report_data[3] = 0xff;
+	report_data[4] = 0x08;
+	report_data[5] = 0x00;
+	
+	res = send_report(dev, report_data, request_size);
+	if (res != request_size) {
+		fprintf(stderr, "Failed to send 'set address and len' command\n");
+		return res;
+	}
+
+	/* Read VID and PID */
+	memset(report_data, 0, request_size);
+	report_data[0] = 0x05;
+	report_data[1] = 0x72;
+
+	res = get_report(dev, report_data, request_size);
+	if (res != request_size) {
+		fprintf(stderr, "Failed to read VID and PID\n");
+		return res;
+	}
+
+	memcpy(record, report_data + 2, 4);
+
+	/* Read serial number */
+	res = get_report(dev, report_data, request_size);
+	if (res != request_size) {
+		fprintf(stderr, "Failed to read serial number\n");
+		return res;
+	}
+	memcpy(record + 4, report_data + 2, 4);
+	memcpy(dev->record, record, sizeof(dev->record));
+	dev->have_record = true;
+
+	return 0;
+}
+
+int do_erase_serial_area(struct device *dev)
+{
+	unsigned char report_data[request_size];
+	int res;
+
+	memset(report_data, 0, request_size);
+	report_data[0] = 0x05; /* report id */
+	report_data[1] = 0x65;
+	report_data[2] = 0xff;
+	report_data[3] = 0x00;
+	report_data[4] = 0x00;
+	report_data[5] = 0x00;
+	res = send_report(dev, report_data, request_size);
+	if (res != request_size) {
+		fprintf(stderr, "Failed to send erase command\n");
+		return res;
+	}
+
+	return 0;
+}
+
+/*
+ * Serial number pool is a text file with the next serial number to hand
+ * out and the last one available, e.g. "0x1000 0x1fff", followed by one
+ * line per number that was handed out but did not make it to a device.
+ * Those are handed out again first. The pool stays locked for every
+ * read-modify-write and is synced before the number is used, so
+ * processes and stations sharing it never get the same number. A number
+ * is appended to <pool>.log once it was written and verified.
+ */
+#define POOL_MAX_RETURNED 64
+
+struct pool {
+	int fd;
+	long int next, last;
+	long int returned[POOL_MAX_RETURNED];
+	int nreturned;
+};
+
+/* Opens, locks and parses the pool, the lock is released by close() */
+static int pool_open(struct pool *pool)
+{
+	struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	char buf[1024], *line;
+	ssize_t len;
+
+	pool->fd = open(serial_pool, O_RDWR);
+	if (pool->fd < 0) {
+		fprintf(stderr, "Failed to open serial number pool %s: %s\n",
+			serial_pool, strerror(errno));
+		return -1;
+	}
+
+	if (fcntl(pool->fd, F_SETLKW, &lock)) {
+		fprintf(stderr, "Failed to lock serial number pool %s: %s\n",
+			serial_pool, strerror(errno));
+		goto err_out;
+	}
+
+	len = pread(pool->fd, buf, sizeof(buf) - 1, 0);
+	if (len < 0)
+		len = 0;
+	buf[len] = '\0';
+	if (sscanf(buf, "%li %li", &pool->next, &pool->last) != 2 ||
+	    pool->next < 0 || pool->last > 0xffff)
+		goto corrupted;
+
+	pool->nreturned = 0;
+	for (line = strchr(buf, '\n'); line && line[1]; line = strchr(line + 1, '\n')) {
+		long int serial;
+
+		if (sscanf(line + 1, "%li", &serial) != 1 || serial < 0 ||
+		    serial > 0xffff || pool->nreturned == POOL_MAX_RETURNED)
+			goto corrupted;
+		pool->returned[pool->nreturned++] = serial;
+	}
+
+	return 0;
+
+corrupted:
+	fprintf(stderr, "Serial number pool %s is corrupted\n", serial_pool);
+err_out:
+	close(pool->fd);
+	return -1;
+}
+
+/* Writes the pool back and closes it */
+static int pool_close(struct pool *pool)
+{
+	char buf[1024];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "0x%04lx 0x%04lx\n", pool->next,
+		       pool->last);
+	for (int i = 0; i < pool->nreturned; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, "0x%04lx\n",
+				pool->returned[i]);
+
+	if (pwrite(pool->fd, buf, len, 0) != len ||
+	    ftruncate(pool->fd, len) || fsync(pool->fd)) {
+		fprintf(stderr, "Failed to update serial number pool %s: %s\n",
+			serial_pool, strerror(errno));
+		close(pool->fd);
+		return -1;
+	}
+	close(pool->fd);
+
+	return 0;
+}
+
+/* Reserve a number, hand it to pool_commit() or pool_release() once written */
+static long int pool_allocate(void)
+{
+	struct pool pool;
+	long int serial;
+
+	if (pool_open(&pool))
+		return -1;
+
+	if (pool.nreturned) {
+		serial = pool.returned[0];
+		memmove(pool.returned, pool.returned + 1,
+			--pool.nreturned * sizeof(pool.returned[0]));
+	} else if (pool.next <= pool.last) {
+		serial = pool.next++;
+	} else {
+		fprintf(stderr, "Serial number pool %s is exhausted\n", serial_pool);
+		close(pool.fd);
+		return -1;
+	}
+
+	return pool_close(&pool) ? -1 : serial;
+}
+
+/* A number that did not make it to the device goes back to the pool */
+static void pool_release(long int serial)
+{
+	struct pool pool;
+
+	if (!pool_open(&pool)) {
+		if (pool.nreturned < POOL_MAX_RETURNED) {
+			pool.returned[pool.nreturned++] = serial;
+			if (!pool_close(&pool))
+				return;
+		} else {
+			close(pool.fd);
+		}
+	}
+	fprintf(stderr, "Failed to return serial number 0x%04lx to %s\n",
+		serial, serial_pool);
+}
+
+/* Log a number once it is on the device */
+static void pool_commit(const char *device, long int serial, uint16_t old_serial)
+{
+	char buf[PATH_MAX + 64], log_file[PATH_MAX], stamp[32];
+	struct pool pool;
+	time_t now;
+	int len, log_fd = -1;
+
+	/* Under the lock, so the log is in order */
+	if (!pool_open(&pool)) {
+		now = time(NULL);
+		strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+		snprintf(log_file, sizeof(log_file), "%s.log", serial_pool);
+		log_fd = open(log_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		len = snprintf(buf, sizeof(buf), "%s 0x%04lx %s 0x%04x\n", stamp,
+			       serial, device, (int)old_serial);
+		if (log_fd >= 0 && (write(log_fd, buf, len) != len || fsync(log_fd))) {
+			close(log_fd);
+			log_fd = -1;
+		}
+		close(pool.fd);
+	}
+	if (log_fd < 0)
+		fprintf(stderr, "Failed to log serial number 0x%04lx to %s.log\n",
+			serial, serial_pool);
+	else
+		close(log_fd);
+}
+
+/* Record as stored at 0xff80 */
+void serial_record(unsigned char *record, uint16_t vid, uint16_t pid,
+		   uint16_t serial_num)
+{
+	record[0] = (vid >> 8) & 0xff;
+	record[1] = (vid & 0xff);
+	record[2] = (pid >> 8) & 0xff;
+	record[3] = (pid & 0xff);
+	record[4] = (1) & 0xff; /* m_sensor_direct */
+	record[5] = 0x00;
+	record[6] = (serial_num >> 8) & 0xff;
+	record[7] = (serial_num & 0xff);
+}
+
+/* Area has to be erased first */
+int do_write_serial_area(struct device *dev, const unsigned char *record)
+{
+	unsigned char report_data[request_size];
+	int res;
+
+	/* Write VID PID Serial number */
+	memset(report_data, 0, request_size);
+	report_data[0] = 0x05; /* report id */
+	report_data[1] = 0x57;
+	report_data[2] = 0x80;
+	report_data[3] = 0xff;
+	report_data[4] = 0x08;
+	report_data[5] = 0x00;
+	res = send_report(dev, report_data, request_size);
+	if (res != request_size) {
+		fprintf(stderr, "Failed to send write command\n");
+		return res;
+	}
+
+	/* First VID and PID */
+	report_data[0] = 0x05; /* report id */
+	report_data[1] = 0x77;
+	memcpy(report_data + 2, record, 4);
+	res = send_report(dev, report_data, request_size);
+	if (res != request_size) {
+		fprintf(stderr, "Failed to write VID and PID\n");
+		return res;
+	}
+
+	/* Then serial */
+	report_data[0] = 0x05; /* report id */
+	report_data[1] = 0x77;
+	memcpy(report_data + 2, record + 4, 4);
+	res = send_report(dev, report_data, request_size);
+	if (res != request_size) {
+		fprintf(stderr, "Failed to write VID and PID\n");
+		return res;
+	}
+
+	return 0;
+}
+
+int do_verify_serial_area(struct device *dev, const unsigned char *record)
+{
+	unsigned char read_back[8];
+	int res;
+
+	res = do_read_serial_area(dev, read_back);
+	if (res)
+		return res;
+
+	if (memcmp(record, read_back, sizeof(read_back))) {
+		fprintf(stderr, "Serial number area read from device differs from written!\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Rewrite the serial number area, with a new serial number unless it is
+ * -1, or one from the pool if it is SERIAL_FROM_POOL. The area is only
+ * erased if it does not hold the record already.
+ */
+int do_rewrite_serial_area(struct device *dev, const unsigned char *record)
+{
+	int res;
+
+	/* Erase this area */
+	res = do_erase_serial_area(dev);
+	if (res)
+		return res;
+	usleep(dev->serial_erase_us);
+
+	res = do_write_serial_area(dev, record);
+	if (res)
+		return res;
+
+	return do_verify_serial_area(dev, record);
+}
+
+int do_write_serial_number(struct device *dev, long int new_serial)
+{
+	unsigned char current[8], record[8];
+	uint16_t vid, pid, serial_num, old_serial;
+	bool from_pool = new_serial == SERIAL_FROM_POOL;
+	int res;
+
+	res = do_read_serial_area(dev, current);
+	if (res)
+		return res;
+
+	vid = current[0] << 8 | current[1];
+	pid = current[2] << 8 | current[3];
+	serial_num = old_serial = current[6] << 8 | current[7];
+
+	printf("VID: %.4x PID: %.4x Serial: %.4x\n", (int)vid, (int)pid, (int)serial_num);
+	if (from_pool) {
+		new_serial = pool_allocate();
+		if (new_serial < 0)
+			return -1;
+	}
+	if (new_serial >= 0) {
+		serial_num = new_serial;
+		printf("New serial: %.4x\n", (int)serial_num);
+	}
+
+	serial_record(record, vid, pid, serial_num);
+	if (!memcmp(current, record, sizeof(record))) {
+		printf("Serial number area is up to date\n");
+		res = 0;
+	} else {
+		res = do_rewrite_serial_area(dev, record);
+	}
+
+	if (from_pool && res)
+		pool_release(new_serial);
+	else if (from_pool)
+		pool_commit(dev->path, new_serial, old_serial);
+
+	return res;
+}
+
+/* Erase pages 0-6 */
+int do_erase_fw(struct device *dev)
+{
+	unsigned char report_data[request_size];
+	int res;
+
+	memset(report_data, 0x45, request_size);
+	report_data[0] = 0x05; /* report id */
+	res = send_report(dev, report_data, request_size);
+	if (res != request_size) {
+		fprintf(stderr, "Failed to send erase command\n");
+		return res;
+	}
+
+	return 0;
+}
+
+int do_end_programming(struct device *dev)
+{
+	unsigned char report_data[request_size];
+	int res;
+
+	memset(report_data, 0x55, request_size);
+	report_data[0] = 0x05; /* report id */
+	res = send_report(dev, report_data, request_size);
+	if (res != request_size) {
+		fprintf(stderr, "Failed to send end programming\n");
+		return res;
+	}
+
+	return 0;
+}
+
+/* RESUME_COMMIT as first_block only sends block 0 again as the commit frame */
+int do_write_fw(struct device *dev, const struct flash_plan *plan, int first_block)
+{
+	int res;
+
+	if (first_block == RESUME_COMMIT)
+		goto commit;
+
+	res = send_report(dev, plan->write_headers[first_block], request_size);
+	if (res != request_size) {
+		fprintf(stderr, "Failed to send 1st write command\n");
+		return res;
+	}
+
+	for (int i = first_block; i < plan->nblocks; i++)
+	{
+		res = send_report(dev, plan->frames[i], sizeof(plan->frames[i]));
+		if (res != sizeof(plan->frames[i])) {
+			fprintf(stderr, "Failed to write data\n");
+			return res;
+		}
+		/* Journal sync overlaps with pacing */
+		journal_record("block %d\n", i);
+		pace(dev);
+	}
+
+commit:
+	res = send_report(dev, plan->write_headers[0], request_size);
+	if (res != request_size) {
+		fprintf(stderr, "Failed to send 2nd write command\n");
+		return res;
+	}
+
+	res = send_report(dev, plan->commit_frame, sizeof(plan->commit_frame));
+	if (res != sizeof(plan->commit_frame)) {
+		fprintf(stderr, "Failed to write data\n");
+		return res;
+	}
+	pace(dev);
+	journal_record("done\n");
+
+	return 0;
+}
+
+/*
+ * Recovery escalates with the failures of a step: the first is simply
+ * retried, the second resets the device and re-opens it on the same
+ * port, later ones also erase and rewrite the image from scratch. Time
+ * of a tier runs until the attempt after it has finished.
+ */
+enum recovery_tier {
+	TIER_RETRY,
+	TIER_RESET,
+	TIER_RESTART,
+};
+
+static void recovery_end(struct device *dev)
+{
+	if (dev->tier < 0)
+		return;
+
+	dev->tier_us[dev->tier] += now_us() - dev->tier_start;
+	dev->tier = -1;
+}
+
+static int recover(struct device *dev, const struct flash_plan *plan,
+		   int failures, bool rewrite)
+{
+	enum recovery_tier tier = failures < TIER_RESTART ? failures : TIER_RESTART;
+
+	dev->tier = tier;
+	dev->tier_start = now_us();
+	dev->tier_count[tier]++;
+	if (tier == TIER_RETRY)
+		return 0;
+
+	fprintf(stderr, "Resetting %s%s\n", dev->path,
+		tier == TIER_RESTART ? " and starting over" : "");
+	if (dev->hid && usb_reset(dev->path))
+		fprintf(stderr, "Failed to reset %s\n", dev->path);
+	if (reopen_device(dev))
+		return -1;
+	if (tier == TIER_RESET)
+		return 0;
+
+	/* A failed restart is left to the next attempt to find out */
+	journal_start(plan);
+	phase_begin(dev, "erase");
+	if (do_erase_fw(dev))
+		return 0;
+	journal_record("erase\n");
+	if (rewrite) {
+		phase_begin(dev, "write");
+		do_write_fw(dev, plan, 0);
+	}
+
+	return 0;
+}
+
+/*
+ * Erase pages 0-6, then write the image and verify it. A non-zero
+ * first_block resumes an interrupted write without erasing, see
+ * journal_resume().
+ */
+int flash_image(struct device *dev, const struct flash_plan *plan, int first_block)
+{
+	unsigned char read_data[plan->length];
+	int retries, res;
+
+	dev->image_crc = plan->crc;
+	if (!first_block) {
+		journal_start(plan);
+		phase_begin(dev, "erase");
+		if (do_erase_fw(dev))
+			return -1;
+		journal_record("erase\n");
+	}
+
+	retries = max_retries;
+	do {
+		if (first_block == plan->nblocks)
+			break;
+		phase_begin(dev, "write");
+		res = do_write_fw(dev, plan, first_block);
+		recovery_end(dev);
+		if (!res)
+			break;
+		phase_failed(dev);
+		fprintf(stderr, "Failed to write firmware. Retrying... (%d attempts left)\n", retries);
+		first_block = 0;
+		if (retries && recover(dev, plan, max_retries - retries, false))
+			return -1;
+	} while (retries--);
+
+	if (retries < 0)
+		return -1;
+
+	retries = max_retries;
+
+	do {
+		phase_begin(dev, "verify");
+		res = do_read_fw(dev, read_data, plan->length);
+		recovery_end(dev);
+		if (!res) {
+			if (!memcmp(plan->image, read_data, plan->length))
+				break;
+			else
+				fprintf(stderr, "Firmware read from device differs from written!\n");
+		}
+		phase_failed(dev);
+		fprintf(stderr, "Firmware comparison failed. Retrying... (%d attempts left)\n", retries);
+		if (retries && recover(dev, plan, max_retries - retries, true))
+			return -1;
+	} while (retries--);
+
+	if (retries < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Returns 0 or one of EXIT_* codes */
+int load_image(const char *file, unsigned char *data, long int data_lenght)
+{
+	FILE *in;
+	ssize_t offset = 0;
+	bool blank = true;
+
+	in = fopen(file, "rb");
+	if (!in) {
+		fprintf(stderr, "Failed to open %s for read\n", file);
+		return EXIT_FAILURE;
+	}
+
+	memset(data, 0, data_lenght);
+	while (offset < data_lenght) {
+		ssize_t bytes = fread(data + offset, 1, data_lenght - offset, in);
+		if (!bytes)
+			break;
+		offset += bytes;
+	}
+
+	if (offset == data_lenght && fgetc(in) != EOF) {
+		fclose(in);
+		fprintf(stderr, "Firmware is larger than %ld bytes\n", data_lenght);
+		return EXIT_BAD_IMAGE;
+	}
+	fclose(in);
+
+	if (offset != data_lenght) {
+		fprintf(stderr, "Short firmware: %d bytes\n", (int)offset);
+		return EXIT_BAD_IMAGE;
+	}
+
+	if (data[0] == ':') {
+		fprintf(stderr, "Firmware looks like Intel HEX, convert it to binary first\n");
+		return EXIT_BAD_IMAGE;
+	}
+
+	for (long int i = 1; i < data_lenght && blank; i++)
+		blank = data[i] == data[0];
+	if (blank) {
+		fprintf(stderr, "Firmware is blank\n");
+		return EXIT_BAD_IMAGE;
+	}
+
+	return 0;
+}
+
+/*
+ * Firmware bundle, a text manifest with one line per variant followed by
+ * the images of the variants in the same order:
+ *
+ *   pbtp-bundle 1
+ *   variant name size=n request_size=n vid=n pid=n serial=lo-hi crc=n
+ *   ...
+ *   end
+ *
+ * Everything after the name is optional. The first variant whose rules
+ * all match is written to a device: vid, pid and serial against its
+ * serial number area, crc against the CRC32 of its current firmware and
+ * request_size against the size the device answers to. size can not be
+ * over the 14 KiB the erase command clears. A plain image is loaded as a
+ * bundle with one variant and no rules.
+ */
+#define BUNDLE_MAGIC "pbtp-bundle 1\n"
+#define BUNDLE_MAX_VARIANTS 16
+
+struct bundle_variant {
+	char name[32];
+	long int size;
+	long int request_size;		/* 0 to keep the current one */
+	long int vid, pid, serial_min, serial_max, crc;	/* -1 matches any */
+	const unsigned char *image;
+	struct flash_plan *plan;	/* built on first use */
+	long int plan_request_size;
+};
+
+struct bundle {
+	bool plain;
+	int nvariants;
+	unsigned char *data;
+	struct bundle_variant variants[BUNDLE_MAX_VARIANTS];
+};
+
+void bundle_free(struct bundle *b)
+{
+	if (!b)
+		return;
+
+	for (int i = 0; i < b->nvariants; i++)
+		plan_free(b->variants[i].plan);
+	free(b->data);
+	free(b);
+}
+
+static int bundle_parse_variant(struct bundle_variant *v, char *line)
+{
+	char *tok = strtok(line, " \t\r\n");
+
+	if (!tok || strcmp(tok, "variant") || !(tok = strtok(NULL, " \t\r\n")))
+		return -1;
+	snprintf(v->name, sizeof(v->name), "%s", tok);
+	v->size = FIRMWARE_SIZE;
+	v->vid = v->pid = v->serial_min = v->serial_max = v->crc = -1;
+
+	while ((tok = strtok(NULL, " \t\r\n"))) {
+		char *val = strchr(tok, '='), *end;
+		unsigned long n, last;
+
+		if (!val)
+			return -1;
+		*val++ = '\0';
+		n = strtoul(val, &end, 0);
+		last = n;
+		if (end != val && *end == '-' && !strcmp(tok, "serial")) {
+			val = end + 1;
+			last = strtoul(val, &end, 0);
+		}
+		if (end == val || *end)
+			return -1;
+
+		if (!strcmp(tok, "size") && n && n % BLOCK_SIZE == 0 &&
+		    n <= FIRMWARE_SIZE)
+			v->size = n;
+		else if (!strcmp(tok, "request_size") && n >= 6 && n <= 256)
+			v->request_size = n;
+		else if (!strcmp(tok, "vid") && n <= 0xffff)
+			v->vid = n;
+		else if (!strcmp(tok, "pid") && n <= 0xffff)
+			v->pid = n;
+		else if (!strcmp(tok, "serial") && n <= last && last <= 0xffff) {
+			v->serial_min = n;
+			v->serial_max = last;
+		} else if (!strcmp(tok, "crc") && n <= 0xffffffff)
+			v->crc = n;
+		else
+			return -1;
+	}
+
+	return 0;
+}
+
+static bool is_bundle(const char *file)
+{
+	char line[sizeof(BUNDLE_MAGIC)];
+	FILE *in = fopen(file, "rb");
+	bool res;
+
+	if (!in)
+		return false;
+	res = fgets(line, sizeof(line), in) && !strcmp(line, BUNDLE_MAGIC);
+	fclose(in);
+
+	return res;
+}
+
+/* Returns 0 or one of EXIT_* codes */
+int bundle_load(const char *file, struct bundle **out)
+{
+	struct bundle *b = calloc(1, sizeof(*b));
+	long int total = 0, offset = 0;
+	char line[256];
+	bool end = false;
+	int res = EXIT_BAD_IMAGE;
+	FILE *in;
+
+	in = fopen(file, "rb");
+	if (!in) {
+		fprintf(stderr, "Failed to open %s for read\n", file);
+		free(b);
+		return EXIT_FAILURE;
+	}
+
+	if (!fgets(line, sizeof(line), in) || strcmp(line, BUNDLE_MAGIC)) {
+		struct bundle_variant *v = &b->variants[0];
+
+		fclose(in);
+		b->plain = true;
+		b->data = malloc(FIRMWARE_SIZE);
+		res = load_image(file, b->data, FIRMWARE_SIZE);
+		if (res) {
+			bundle_free(b);
+			return res;
+		}
+		b->nvariants = 1;
+		snprintf(v->name, sizeof(v->name), "image");
+		v->size = FIRMWARE_SIZE;
+		v->vid = v->pid = v->serial_min = v->serial_max = v->crc = -1;
+		v->image = b->data;
+		*out = b;
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), in)) {
+		if (!strcmp(line, "end\n")) {
+			end = true;
+			break;
+		}
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (b->nvariants == BUNDLE_MAX_VARIANTS) {
+			fprintf(stderr, "%s: more than %d variants\n", file,
+				BUNDLE_MAX_VARIANTS);
+			goto err_out;
+		}
+		if (bundle_parse_variant(&b->variants[b->nvariants], line)) {
+			fprintf(stderr, "%s: invalid variant line %d\n", file,
+				b->nvariants + 1);
+			goto err_out;
+		}
+		total += b->variants[b->nvariants++].size;
+	}
+	if (!end || !b->nvariants) {
+		fprintf(stderr, "%s: manifest has no variants or no end\n", file);
+		goto err_out;
+	}
+
+	b->data = malloc(total);
+	if (fread(b->data, 1, total, in) != total || fgetc(in) != EOF) {
+		fprintf(stderr, "%s: images do not match the sizes in the manifest\n", file);
+		goto err_out;
+	}
+
+	for (int i = 0; i < b->nvariants; i++) {
+		struct bundle_variant *v = &b->variants[i];
+		bool blank = true;
+
+		v->image = b->data + offset;
+		offset += v->size;
+		for (long int j = 1; j < v->size && blank; j++)
+			blank = v->image[j] == v->image[0];
+		if (blank) {
+			fprintf(stderr, "%s: image of %s is blank\n", file, v->name);
+			goto err_out;
+		}
+	}
+	fclose(in);
+
+	*out = b;
+	return 0;
+
+err_out:
+	fclose(in);
+	bundle_free(b);
+	return res;
+}
+
+/* Try the given request size, then the ones of the bundle, until one is answered */
+static int bundle_request_size(struct device *dev, const struct bundle *b,
+			       unsigned char *record)
+{
+	long int given = request_size;
+
+	if (given && !do_read_serial_area(dev, record))
+		return 0;
+
+	for (int i = 0; i < b->nvariants; i++) {
+		long int size = b->variants[i].request_size;
+		bool tried = !size || size == given;
+
+		for (int j = 0; j < i && !tried; j++)
+			tried = b->variants[j].request_size == size;
+		if (tried)
+			continue;
+
+		request_size = size;
+		if (!do_read_serial_area(dev, record)) {
+			printf("%s: request size is %ld\n", dev->path, size);
+			dev->request_size = size;
+			return 0;
+		}
+	}
+
+	request_size = given;
+	return -1;
+}
+
+/* Reads what the rules need from the device, NULL if nothing matches */
+struct bundle_variant *bundle_select(struct device *dev, struct bundle *b)
+{
+	unsigned char record[8], current[FIRMWARE_SIZE];
+	long int current_size = 0, crc_size = 0, serial;
+
+	if (b->plain)
+		return &b->variants[0];
+
+	if (bundle_request_size(dev, b, record)) {
+		fprintf(stderr, "%s: serial number area is not readable with any request size of the bundle\n",
+			dev->path);
+		return NULL;
+	}
+	serial = record[6] << 8 | record[7];
+	for (int i = 0; i < b->nvariants; i++) {
+		if (b->variants[i].crc >= 0 && b->variants[i].size > crc_size)
+			crc_size = b->variants[i].size;
+	}
+
+	for (int i = 0; i < b->nvariants; i++) {
+		struct bundle_variant *v = &b->variants[i];
+
+		if ((v->request_size && v->request_size != request_size) ||
+		    (v->vid >= 0 && v->vid != (record[0] << 8 | record[1])) ||
+		    (v->pid >= 0 && v->pid != (record[2] << 8 | record[3])) ||
+		    (v->serial_min >= 0 &&
+		     (serial < v->serial_min || serial > v->serial_max)))
+			continue;
+
+		if (v->crc >= 0) {
+			/* One readback serves all variants */
+			if (!current_size) {
+				current_size = crc_size;
+				if (do_read_fw(dev, current, current_size)) {
+					fprintf(stderr, "%s: failed to read current firmware\n",
+						dev->path);
+					return NULL;
+				}
+			}
+			if (crc32(current, v->size) != v->crc)
+				continue;
+		}
+
+		printf("%s: variant %s (%ld bytes, request size %ld)\n", dev->path,
+		       v->name, v->size, request_size);
+		return v;
+	}
+
+	fprintf(stderr, "%s: no variant matches VID: %.2x%.2x PID: %.2x%.2x Serial: %.4lx\n",
+		dev->path, record[0], record[1], record[2], record[3], serial);
+	return NULL;
+}
+
+/* Plans hold headers of the request size, so they follow it */
+const struct flash_plan *bundle_plan(struct bundle_variant *v)
+{
+	if (v->plan && v->plan_request_size != request_size) {
+		plan_free(v->plan);
+		v->plan = NULL;
+	}
+	if (!v->plan) {
+		v->plan = plan_build(v->image, v->size);
+		v->plan_request_size = request_size;
+	}
+
+	return v->plan;
+}
+
+/*
+ * Non-destructive checks run in batch mode before anything is erased.
+ * Returns 0 or one of EXIT_* codes.
+ */
+int preflight(struct device *dev)
+{
+	unsigned char record[8];
+	uint16_t vid, pid;
+	int res;
+
+	res = do_read_serial_area(dev, record);
+	if (res < 0) {
+		fprintf(stderr, "Pre-flight: device is not responding\n");
+		return EXIT_NO_DEVICE;
+	} else if (res) {
+		fprintf(stderr, "Pre-flight: device returned %d bytes, request size %ld is wrong\n",
+			res, request_size);
+		return EXIT_REPORT_SIZE;
+	}
+
+	vid = record[0] << 8 | record[1];
+	pid = record[2] << 8 | record[3];
+	if (vid != USB_DEVICE_VID || pid != USB_DEVICE_PID) {
+		fprintf(stderr, "Pre-flight: serial number area is not readable (VID: %.4x PID: %.4x)\n",
+			(int)vid, (int)pid);
+		return EXIT_SERIAL;
+	}
+
+	return 0;
+}
+
+/*
+ * A few round trips before erasing: the serial number record and one
+ * full block. A link that loses too many of them fails here, while the
+ * device still boots. One that loses some or is slow gets conservative
+ * pacing.
+ */
+#define PROBE_ROUNDS 5
+#define PROBE_MAX_FAILED 1
+#define PROBE_SLOW_US 20000
+
+int link_probe(struct device *dev)
+{
+	unsigned char header[request_size];
+	unsigned char frame[BLOCK_SIZE + 2];
+	unsigned char record[8];
+	uint64_t start, us, total_us = 0, max_us = 0;
+	int failed = 0;
+
+	set_header(header, 0x52, 0, BLOCK_SIZE);
+	for (int i = 0; i < PROBE_ROUNDS; i++) {
+		phase_begin(dev, "probe");
+		if (do_read_serial_area(dev, record) ||
+		    send_report(dev, header, request_size) != request_size) {
+			failed++;
+			continue;
+		}
+
+		memset(frame, 0, sizeof(frame));
+		frame[0] = 0x06;
+		frame[1] = 0x72;
+		start = now_us();
+		if (get_report(dev, frame, sizeof(frame)) != sizeof(frame)) {
+			failed++;
+			continue;
+		}
+		us = now_us() - start;
+		total_us += us;
+		if (us > max_us)
+			max_us = us;
+		pace(dev);
+	}
+
+	printf("%s: link probe: %d of %d round trips failed", dev->path, failed,
+	       PROBE_ROUNDS);
+	if (failed < PROBE_ROUNDS)
+		printf(", block read %.1f ms average, %.1f ms max",
+		       total_us / 1000.0 / (PROBE_ROUNDS - failed), max_us / 1000.0);
+	printf("\n");
+
+	if (failed > PROBE_MAX_FAILED) {
+		fprintf(stderr, "%s: link is not reliable enough to erase the device\n",
+			dev->path);
+		return EXIT_LINK;
+	}
+	if ((failed || max_us > PROBE_SLOW_US) && dev->pacing_us < 2 * REPORT_PACING_US) {
+		dev->pacing_us = 2 * REPORT_PACING_US;
+		dev->serial_erase_us = SERIAL_ERASE_US;
+		printf("%s: marginal link, pacing reports %ld us apart\n",
+		       dev->path, dev->pacing_us);
+	}
+
+	return 0;
+}
+
+/*
+ * After end programming the device resets into normal mode. Wait until
+ * the interface we programmed through goes away, or the USB device node
+ * it was on before end programming changes, and the device shows up
+ * again with its keyboard and mouse interfaces. A device that never
+ * resets is not ready.
+ */
+int wait_ready(const char *path, const char *node, long int timeout_ms)
+{
+	uint64_t start = now_us();
+	uint64_t elapsed;
+	bool gone = false;
+
+	do {
+		struct hid_device_info *devs, *cur;
+		bool present = false, unknown_usage = false;
+		unsigned int usages = 0;
+		char current[32];
+		int interfaces = 0;
+
+		devs = hid_enumerate(USB_DEVICE_VID, USB_DEVICE_PID);
+		for (cur = devs; cur; cur = cur->next) {
+			if (!strcmp(cur->path, path))
+				present = true;
+			interfaces++;
+			/* Older libusb backends do not report usages */
+			if (!cur->usage_page)
+				unknown_usage = true;
+			else if (cur->usage_page == USAGE_PAGE_GENERIC_DESKTOP &&
+				 (cur->usage == USAGE_MOUSE || cur->usage == USAGE_KEYBOARD))
+				usages |= 1u << cur->usage;
+		}
+		hid_free_enumeration(devs);
+
+		elapsed = now_us() - start;
+		if (!present)
+			gone = true;
+		/* Back on the same path before we polled, but as a new USB device */
+		if (present && node[0] &&
+		    (usb_device_node(path, current, sizeof(current)) ||
+		     strcmp(current, node)))
+			gone = true;
+
+		if (gone && (usages == (1u << USAGE_MOUSE | 1u << USAGE_KEYBOARD) ||
+			     (unknown_usage && interfaces > 1))) {
+			printf("Device is ready after %.1f ms\n", elapsed / 1000.0);
+			return 0;
+		}
+
+		usleep(20000);
+	} while (elapsed < (uint64_t)timeout_ms * 1000);
+
+	if (gone)
+		fprintf(stderr, "Device did not come back in %ld ms\n", timeout_ms);
+	else
+		fprintf(stderr, "Device did not reset in %ld ms, still in programming mode?\n",
+			timeout_ms);
+	return -1;
+}
+
+int write_fw(void)
+{
+	unsigned char backup_data[FIRMWARE_SIZE];
+	char node[32];
+	int res;
+	int ret = EXIT_FAILURE;
+	int retries;
+	int first_block = 0;
+	bool rolled_back = false;
+	struct bundle *bundle;
+	struct bundle_variant *variant;
+	const struct flash_plan *plan;
+	struct flash_plan *backup = NULL;
+
+	struct device dev;
+
+	res = bundle_load(firmware_file, &bundle);
+	if (res)
+		return res;
+
+	res = open_device(&dev);
+	if (res) {
+		fprintf(stderr, "Failed to open device\n");
+		bundle_free(bundle);
+		return res == -EBUSY ? EXIT_BUSY : EXIT_NO_DEVICE;
+	}
+
+	phase_begin(&dev, "select");
+	variant = bundle_select(&dev, bundle);
+	if (!variant) {
+		ret = EXIT_NO_VARIANT;
+		goto err_out;
+	}
+	plan = bundle_plan(variant);
+
+	if (batch_mode) {
+		phase_begin(&dev, "preflight");
+		res = preflight(&dev);
+		if (res) {
+			ret = res;
+			goto err_out;
+		}
+	}
+
+	if (journal_file) {
+		phase_begin(&dev, "resume");
+		first_block = journal_resume(&dev, plan);
+		if (journal_open())
+			goto err_out;
+	}
+
+	if (!first_block) {
+		res = link_probe(&dev);
+		if (res) {
+			ret = res;
+			goto err_out;
+		}
+	}
+
+	if (first_block) {
+		if (first_block == RESUME_COMMIT)
+			printf("Resuming with the commit frame\n");
+		else
+			printf("Resuming from block %d\n", first_block);
+		if (do_rollback)
+			fprintf(stderr, "Device is already erased, rollback is not possible\n");
+	} else if (!batch_mode) {
+		printf("You have 5 seconds to press CTRL+C\n");
+		fflush(stdout);
+		sleep(5);
+	}
+
+	/*
+	 * Keep current firmware around, it is erased below. The erase clears
+	 * all 14 KiB whatever the length of the variant, so back all of it up.
+	 */
+	if (do_rollback && !first_block) {
+		retries = max_retries;
+		do {
+			phase_begin(&dev, "backup");
+			if (!do_read_fw(&dev, backup_data, FIRMWARE_SIZE))
+				break;
+			phase_failed(&dev);
+			fprintf(stderr, "Failed to read current firmware. Retrying... (%d attempts left)\n", retries);
+		} while (retries--);
+
+		if (retries < 0) {
+			fprintf(stderr, "Failed to back up current firmware\n");
+			goto err_out;
+		}
+	}
+
+	if (flash_image(&dev, plan, first_block)) {
+		if (!do_rollback || first_block)
+			goto err_out;
+
+		fprintf(stderr, "Failed to flash firmware, rolling back\n");
+		backup = plan_build(backup_data, FIRMWARE_SIZE);
+		if (flash_image(&dev, backup, 0)) {
+			fprintf(stderr, "Rollback failed!\n");
+			goto err_out;
+		}
+		fprintf(stderr, "Rolled back to previous firmware\n");
+		rolled_back = true;
+	}
+
+	/* Write serial number */
+	phase_begin(&dev, "serial");
+	res = do_write_serial_number(&dev, serial_pool && !rolled_back ?
+				     SERIAL_FROM_POOL : -1);
+	if (res) {
+		fprintf(stderr, "Failed to write serial number\n");
+		goto err_out;
+	}
+
+	/* Send end programming command */
+	/* Tells wait_ready() the device re-enumerated */
+	if (usb_device_node(dev.path, node, sizeof(node)))
+		node[0] = '\0';
+
+	phase_begin(&dev, "end");
+	if (do_end_programming(&dev))
+		goto err_out;
+
+	journal_close(!rolled_back);
+	hid_close(dev.hid);
+	dev.hid = NULL;
+	bundle_free(bundle);
+	plan_free(backup);
+
+	res = ready_timeout ? wait_ready(dev.path, node, ready_timeout) : 0;
+	ret = res ? EXIT_NOT_READY : rolled_back ? EXIT_ROLLED_BACK : 0;
+	trace_record(&dev, "write", ret);
+	close_device(&dev);
+
+	return ret;
+
+err_out:
+	journal_close(false);
+	trace_record(&dev, "write", ret);
+	close_device(&dev);
+	bundle_free(bundle);
+	plan_free(backup);
+	return ret;
+}
+
+/*
+ * Find the fastest pacing and serial erase wait that work for this port
+ * a few times in a row, halving from the defaults, and keep twice that
+ * as margin. Writes the image at every pacing step, so the device ends
+ * up with it written and verified at the calibrated timing.
+ *
+ * Only the serial number area can tell the serial erase wait, so that
+ * part erases the identity record. Erases of it are capped, and after a
+ * failed trial the record is put back at the default wait right away.
+ */
+#define CALIBRATE_TRIALS 3
+#define CALIBRATE_MIN_US 500
+#define CALIBRATE_SERIAL_ERASES 12
+
+static bool calibrate_pacing(struct device *dev, const struct flash_plan *plan)
+{
+	unsigned char read_data[plan->length];
+
+	for (int i = 0; i < CALIBRATE_TRIALS; i++) {
+		phase_begin(dev, "calibrate");
+		if (do_erase_fw(dev) || do_write_fw(dev, plan, 0) ||
+		    do_read_fw(dev, read_data, plan->length) ||
+		    memcmp(read_data, plan->image, plan->length))
+			return false;
+	}
+
+	return true;
+}
+
+/* Counts the serial area erases in *erases, false once a trial failed */
+static bool calibrate_serial(struct device *dev, const unsigned char *record,
+			     int *erases)
+{
+	for (int i = 0; i < CALIBRATE_TRIALS; i++) {
+		phase_begin(dev, "calibrate");
+		(*erases)++;
+		if (do_rewrite_serial_area(dev, record))
+			return false;
+	}
+
+	return true;
+}
+
+/* Put the record back at the default erase wait, unless it survived */
+static int calibrate_restore_serial(struct device *dev,
+				    const unsigned char *record, int *erases)
+{
+	long int us = dev->serial_erase_us;
+	int retries = max_retries;
+	int res;
+
+	phase_begin(dev, "serial");
+	if (!do_verify_serial_area(dev, record))
+		return 0;
+
+	dev->serial_erase_us = SERIAL_ERASE_US;
+	do {
+		phase_begin(dev, "serial");
+		(*erases)++;
+		res = do_rewrite_serial_area(dev, record);
+	} while (res && retries--);
+	dev->serial_erase_us = us;
+
+	return res;
+}
+
+int calibrate_timing(void)
+{
+	long int data_lenght = FIRMWARE_SIZE;
+	unsigned char data[data_lenght];
+	unsigned char record[8];
+	struct flash_plan *plan;
+	struct device dev;
+	long int best_pacing = 0, best_erase = 0;
+	int ret = EXIT_FAILURE;
+	int erases = 0;
+	int res;
+
+	res = load_image(firmware_file, data, data_lenght);
+	if (res)
+		return res;
+
+	res = open_device(&dev);
+	if (res) {
+		fprintf(stderr, "Failed to open device\n");
+		return res == -EBUSY ? EXIT_BUSY : EXIT_NO_DEVICE;
+	}
+	plan = plan_build(data, data_lenght);
+
+	phase_begin(&dev, "preflight");
+	res = preflight(&dev);
+	if (res) {
+		ret = res;
+		goto err_out;
+	}
+	/* Pre-flight checked it, it is restored from this copy */
+	do_read_serial_area(&dev, record);
+
+	if (!batch_mode) {
+		printf("You have 5 seconds to press CTRL+C\n");
+		fflush(stdout);
+		sleep(5);
+	}
+
+	for (long int us = REPORT_PACING_US; us >= CALIBRATE_MIN_US; us /= 2) {
+		dev.pacing_us = us;
+		if (!calibrate_pacing(&dev, plan))
+			break;
+		printf("Pacing %ld us: ok\n", us);
+		best_pacing = us;
+	}
+	dev.pacing_us = best_pacing ? 2 * best_pacing : REPORT_PACING_US;
+	if (dev.pacing_us > REPORT_PACING_US)
+		dev.pacing_us = REPORT_PACING_US;
+	/* Let the device finish whatever the failed step left it doing */
+	usleep(SERIAL_ERASE_US);
+
+	for (long int us = SERIAL_ERASE_US; us >= CALIBRATE_MIN_US &&
+	     erases + CALIBRATE_TRIALS <= CALIBRATE_SERIAL_ERASES; us /= 2) {
+		dev.serial_erase_us = us;
+		if (!calibrate_serial(&dev, record, &erases)) {
+			/* Let the device finish the erase the trial left it doing */
+			usleep(SERIAL_ERASE_US);
+			if (calibrate_restore_serial(&dev, record, &erases)) {
+				fprintf(stderr, "Failed to restore serial number area\n");
+				goto err_out;
+			}
+			break;
+		}
+		printf("Serial erase wait %ld us: ok\n", us);
+		best_erase = us;
+	}
+	dev.serial_erase_us = best_erase ? 2 * best_erase : SERIAL_ERASE_US;
+	if (dev.serial_erase_us > SERIAL_ERASE_US)
+		dev.serial_erase_us = SERIAL_ERASE_US;
+
+	/* The last step may have failed half way, leave a good device behind */
+	if (flash_image(&dev, plan, 0)) {
+		fprintf(stderr, "Failed to write firmware at calibrated pacing\n");
+		goto err_out;
+	}
+	if (calibrate_restore_serial(&dev, record, &erases)) {
+		fprintf(stderr, "Failed to restore serial number area\n");
+		goto err_out;
+	}
+	phase_begin(&dev, "end");
+	if (do_end_programming(&dev))
+		goto err_out;
+
+	if (!best_pacing || !best_erase)
+		fprintf(stderr, "Default timing is not reliable on this port\n");
+	printf("Calibrated pacing %ld us, serial erase wait %ld us\n",
+	       dev.pacing_us, dev.serial_erase_us);
+	if (timing_cache && timing_save(&dev))
+		goto err_out;
+	ret = 0;
+
+err_out:
+	close_device(&dev);
+	plan_free(plan);
+
+	return ret;
+}
+
+/*
+ * Flashing several devices at once. Every device is a state machine
+ * that sends one report per step and then sleeps until its next step is
+ * due, so a single thread keeps all of them busy while each one waits
+ * out report pacing and erase times.
+ */
+enum engine_state {
+	STATE_ERASE,
+	STATE_WRITE_HEADER,
+	STATE_WRITE_BLOCK,
+	STATE_COMMIT_HEADER,
+	STATE_COMMIT_BLOCK,
+	STATE_VERIFY_HEADER,
+	STATE_VERIFY_BLOCK,
+	STATE_SERIAL_READ,
+	STATE_SERIAL_ERASE,
+	STATE_SERIAL_WRITE,
+	STATE_END,
+	STATE_DONE,
+	STATE_FAILED,
+};
+
+struct engine_device {
+	struct device dev;
+	enum engine_state state;
+	int block;
+	int retries;
+	uint64_t wake;		/* us, when the next step is due */
+	unsigned char frame[BLOCK_SIZE + 2];	/* readback */
+	unsigned char record[8];	/* serial number area to write */
+	char hub[32];		/* port chain of the parent hub */
+	bool has_slot;		/* holds one of its hub's transfer slots */
+	struct bundle_variant *variant;	/* selected for the device */
+	const struct flash_plan *plan;
+	bool pool_reserved;	/* record holds a number from the pool */
+	uint16_t old_serial;
+};
+
+/* Firmware write and verify move 2 KiB per report, everything else is small */
+static bool engine_transfer_phase(enum engine_state state)
+{
+	return (state >= STATE_WRITE_HEADER && state <= STATE_COMMIT_BLOCK) ||
+	       state == STATE_VERIFY_HEADER || state == STATE_VERIFY_BLOCK;
+}
+
+/* Devices behind the same hub share its bandwidth, limit how many stream at once */
+static bool engine_take_slot(struct engine_device *eds, int ndevs,
+			     struct engine_device *ed)
+{
+	int busy = 0;
+
+	if (ed->has_slot || !per_hub || !ed->hub[0])
+		return true;
+
+	for (int i = 0; i < ndevs; i++) {
+		if (eds[i].has_slot && !strcmp(eds[i].hub, ed->hub))
+			busy++;
+	}
+	if (busy >= per_hub)
+		return false;
+
+	ed->has_slot = true;
+	return true;
+}
+
+/* "1-1.4.2" hangs off hub "1-1.4", "1-1" off the root hub of bus 1 */
+static void engine_set_hub(struct engine_device *ed)
+{
+	char port[32];
+	char *dot;
+
+	if (usb_port_path(ed->dev.path, port, sizeof(port))) {
+		fprintf(stderr, "%s: USB topology is unknown, not limited per hub\n",
+			ed->dev.path);
+		return;
+	}
+
+	dot = strrchr(port, '.');
+	if (dot) {
+		*dot = '\0';
+		snprintf(ed->hub, sizeof(ed->hub), "%s", port);
+	} else {
+		snprintf(ed->hub, sizeof(ed->hub), "usb%.*s",
+			 (int)strcspn(port, "-"), port);
+	}
+	printf("%s: port %s\n", ed->dev.path, port);
+}
+
+static void engine_fail(struct engine_device *ed, const char *what)
+{
+	fprintf(stderr, "%s: Failed to %s\n", ed->dev.path, what);
+	ed->state = STATE_FAILED;
+	if (ed->pool_reserved)
+		pool_release(ed->record[6] << 8 | ed->record[7]);
+	ed->pool_reserved = false;
+}
+
+/* The serial number area holds the record, log a number from the pool */
+static void engine_serial_done(struct engine_device *ed)
+{
+	if (ed->pool_reserved)
+		pool_commit(ed->dev.path, ed->record[6] << 8 | ed->record[7],
+			    ed->old_serial);
+	ed->pool_reserved = false;
+	ed->state = STATE_END;
+}
+
+/* Write and verify attempts restart from their header, like flash_image() */
+static void engine_retry(struct engine_device *ed, enum engine_state restart)
+{
+	const char *what = restart == STATE_WRITE_HEADER ? "write" : "verify";
+
+	phase_failed(&ed->dev);
+	if (ed->retries-- == 0) {
+		engine_fail(ed, restart == STATE_WRITE_HEADER ?
+			    "write firmware" : "verify firmware");
+		return;
+	}
+
+	fprintf(stderr, "%s: Failed to %s firmware. Retrying... (%d attempts left)\n",
+		ed->dev.path, what, ed->retries + 1);
+	ed->state = restart;
+}
+
+static void engine_step(struct engine_device *ed, const struct flash_plan *plan)
+{
+	struct device *dev = &ed->dev;
+	const unsigned char *frame;
+	unsigned char current[8];
+	uint16_t vid, pid, serial_num;
+	int res;
+
+	ed->wake = now_us();
+
+	switch (ed->state) {
+	case STATE_ERASE:
+		phase_begin(dev, "erase");
+		if (do_erase_fw(dev)) {
+			engine_fail(ed, "erase firmware");
+			break;
+		}
+		ed->retries = max_retries;
+		ed->state = STATE_WRITE_HEADER;
+		break;
+
+	case STATE_WRITE_HEADER:
+		phase_begin(dev, "write");
+		/* fall through */
+	case STATE_COMMIT_HEADER:
+		res = send_report(dev, plan->write_headers[0], request_size);
+		if (res != request_size) {
+			engine_retry(ed, STATE_WRITE_HEADER);
+			break;
+		}
+		ed->block = 0;
+		ed->state++;
+		break;
+
+	case STATE_WRITE_BLOCK:
+	case STATE_COMMIT_BLOCK:
+		frame = ed->state == STATE_COMMIT_BLOCK ?
+			plan->commit_frame : plan->frames[ed->block];
+		res = send_report(dev, frame, BLOCK_SIZE + 2);
+		if (res != BLOCK_SIZE + 2) {
+			engine_retry(ed, STATE_WRITE_HEADER);
+			break;
+		}
+		ed->wake = now_us() + dev->pacing_us;
+
+		if (ed->state == STATE_COMMIT_BLOCK) {
+			ed->retries = max_retries;
+			ed->state = STATE_VERIFY_HEADER;
+		} else if (++ed->block == plan->nblocks) {
+			ed->state = STATE_COMMIT_HEADER;
+		}
+		break;
+
+	case STATE_VERIFY_HEADER:
+		phase_begin(dev, "verify");
+		res = send_report(dev, plan->read_header, request_size);
+		if (res != request_size) {
+			engine_retry(ed, STATE_VERIFY_HEADER);
+			break;
+		}
+		ed->block = 0;
+		ed->state = STATE_VERIFY_BLOCK;
+		break;
+
+	case STATE_VERIFY_BLOCK:
+		memset(ed->frame, 0, sizeof(ed->frame));
+		ed->frame[0] = 0x06;
+		ed->frame[1] = 0x72;
+		res = get_report(dev, ed->frame, sizeof(ed->frame));
+		if (res != sizeof(ed->frame)) {
+			engine_retry(ed, STATE_VERIFY_HEADER);
+			break;
+		}
+		ed->wake = now_us() + dev->pacing_us;
+
+		/* Compare as blocks come in, a mismatch fails the pass early */
+		if (memcmp(plan_expected(plan, ed->block, true), ed->frame + 2,
+			   BLOCK_SIZE)) {
+			fprintf(stderr, "%s: Firmware read from device differs from written!\n",
+				dev->path);
+			engine_retry(ed, STATE_VERIFY_HEADER);
+			break;
+		}
+		if (++ed->block == plan->nblocks)
+			ed->state = STATE_SERIAL_READ;
+		break;
+
+	case STATE_SERIAL_READ:
+		phase_begin(dev, "serial");
+		if (do_read_serial_area(dev, current)) {
+			engine_fail(ed, "read serial number");
+			break;
+		}
+		vid = current[0] << 8 | current[1];
+		pid = current[2] << 8 | current[3];
+		serial_num = current[6] << 8 | current[7];
+		printf("%s: VID: %.4x PID: %.4x Serial: %.4x\n", dev->path,
+		       (int)vid, (int)pid, (int)serial_num);
+		ed->old_serial = serial_num;
+		if (serial_pool) {
+			long int new_serial = pool_allocate();
+
+			if (new_serial < 0) {
+				engine_fail(ed, "assign serial number");
+				break;
+			}
+			serial_num = new_serial;
+			ed->pool_reserved = true;
+			printf("%s: New serial: %.4x\n", dev->path, (int)serial_num);
+		}
+
+		/* Same as do_write_serial_number(), skip erase if up to date */
+		serial_record(ed->record, vid, pid, serial_num);
+		if (memcmp(current, ed->record, sizeof(current)))
+			ed->state = STATE_SERIAL_ERASE;
+		else
+			engine_serial_done(ed);
+		break;
+
+	case STATE_SERIAL_ERASE:
+		if (do_erase_serial_area(dev)) {
+			engine_fail(ed, "erase serial number");
+			break;
+		}
+		ed->wake = now_us() + dev->serial_erase_us;
+		ed->state = STATE_SERIAL_WRITE;
+		break;
+
+	case STATE_SERIAL_WRITE:
+		if (do_write_serial_area(dev, ed->record) ||
+		    do_verify_serial_area(dev, ed->record)) {
+			engine_fail(ed, "write serial number");
+			break;
+		}
+		engine_serial_done(ed);
+		break;
+
+	case STATE_END:
+		phase_begin(dev, "end");
+		if (do_end_programming(dev)) {
+			engine_fail(ed, "end programming");
+			break;
+		}
+		ed->state = STATE_DONE;
+		break;
+
+	case STATE_DONE:
+	case STATE_FAILED:
+		break;
+	}
+}
+
+/* One device per programming interface, see open_device() */
+static int engine_open_all(struct engine_device **out)
+{
+	struct hid_device_info *devs, *cur;
+	struct engine_device *eds = NULL;
+	int n = 0;
+
+	if (simulate) {
+		eds = calloc(simulate, sizeof(*eds));
+		for (n = 0; n < simulate; n++) {
+			if (sim_open(&eds[n].dev, n))
+				break;
+		}
+		*out = eds;
+		return n;
+	}
+
+	devs = hid_enumerate(USB_DEVICE_VID, USB_DEVICE_PID);
+	for (cur = devs; cur; cur = cur->next) {
+		struct engine_device *ed;
+
+		if (cur->interface_number > 0)
+			continue;
+
+		eds = realloc(eds, (n + 1) * sizeof(*eds));
+		ed = &eds[n];
+		memset(ed, 0, sizeof(*ed));
+		ed->dev.path = strdup(cur->path);
+		ed->dev.lock_fd = -1;
+		usb_port_path(cur->path, ed->dev.port, sizeof(ed->dev.port));
+		/* Another writer has it, leave it alone */
+		if (device_lock(&ed->dev)) {
+			free(ed->dev.path);
+			continue;
+		}
+		if (reset_on_timeout && usb_reset_check(cur->path)) {
+			close(ed->dev.lock_fd);
+			free(ed->dev.path);
+			continue;
+		}
+		ed->dev.hid = hid_open_path(cur->path);
+		if (!ed->dev.hid) {
+			fprintf(stderr, "%s: Failed to open device\n", cur->path);
+			close(ed->dev.lock_fd);
+			free(ed->dev.path);
+			continue;
+		}
+		ed->dev.opened = now_us();
+		ed->dev.index = n;
+		ed->dev.release = cur->release_number;
+		ed->dev.tier = -1;
+		timing_load(&ed->dev);
+		if (per_hub)
+			engine_set_hub(ed);
+		n++;
+	}
+	hid_free_enumeration(devs);
+
+	if (n && reset_on_timeout)
+		watchdog_init();
+
+	*out = eds;
+	return n;
+}
+
+int write_fw_all(void)
+{
+	struct bundle *bundle;
+	struct engine_device *eds;
+	long int fixed = 0;
+	int ndevs, failed = 0;
+	int res;
+
+	res = bundle_load(firmware_file, &bundle);
+	if (res)
+		return res;
+
+	ndevs = engine_open_all(&eds);
+	if (!ndevs) {
+		fprintf(stderr, "Failed to open device\n");
+		bundle_free(bundle);
+		return EXIT_NO_DEVICE;
+	}
+	printf("Writing firmware to %d devices\n", ndevs);
+
+	/* All devices are driven with the request size of the first match */
+	for (int i = 0; i < ndevs; i++) {
+		struct engine_device *ed = &eds[i];
+
+		phase_begin(&ed->dev, "select");
+		ed->variant = bundle_select(&ed->dev, bundle);
+		if (ed->variant && fixed && request_size != fixed) {
+			fprintf(stderr, "%s: needs request size %ld, write it separately\n",
+				ed->dev.path, request_size);
+			ed->variant = NULL;
+		}
+		if (fixed)
+			request_size = fixed;
+		else if (ed->variant)
+			fixed = request_size;
+		if (!ed->variant)
+			ed->state = STATE_FAILED;
+	}
+	for (int i = 0; i < ndevs; i++) {
+		if (!eds[i].variant)
+			continue;
+		eds[i].plan = bundle_plan(eds[i].variant);
+		eds[i].dev.image_crc = eds[i].plan->crc;
+	}
+
+	if (batch_mode) {
+		for (int i = 0; i < ndevs; i++) {
+			if (eds[i].state == STATE_FAILED)
+				continue;
+			phase_begin(&eds[i].dev, "preflight");
+			if (preflight(&eds[i].dev))
+				eds[i].state = STATE_FAILED;
+		}
+	} else {
+		printf("You have 5 seconds to press CTRL+C\n");
+		fflush(stdout);
+		sleep(5);
+	}
+
+	/* One device at a time, before any of them is erased */
+	for (int i = 0; i < ndevs; i++) {
+		if (eds[i].state != STATE_FAILED && link_probe(&eds[i].dev))
+			eds[i].state = STATE_FAILED;
+	}
+
+	for (;;) {
+		struct engine_device *next = NULL;
+
+		for (int i = 0; i < ndevs; i++) {
+			if (eds[i].state >= STATE_DONE)
+				continue;
+			if (!next || eds[i].wake < next->wake)
+				next = &eds[i];
+		}
+		if (!next)
+			break;
+
+		sleep_until(next->wake);
+
+		if (engine_transfer_phase(next->state) &&
+		    !engine_take_slot(eds, ndevs, next)) {
+			next->wake = now_us() + REPORT_PACING_US;
+			continue;
+		}
+
+		engine_step(next, next->plan);
+
+		if (next->has_slot && !engine_transfer_phase(next->state))
+			next->has_slot = false;
+	}
+
+	for (int i = 0; i < ndevs; i++) {
+		if (eds[i].state == STATE_FAILED)
+			failed++;
+		printf("%s: %s\n", eds[i].dev.path,
+		       eds[i].state == STATE_DONE ? "done" : "FAILED");
+		if (eds[i].state == STATE_DONE)
+			memcpy(eds[i].dev.record, eds[i].record, sizeof(eds[i].record));
+		trace_record(&eds[i].dev, "write",
+			     eds[i].state == STATE_DONE ? 0 : EXIT_FAILURE);
+		close_device(&eds[i].dev);
+	}
+	free(eds);
+	bundle_free(bundle);
+
+	if (failed) {
+		fprintf(stderr, "%d of %d devices failed\n", failed, ndevs);
+		return EXIT_FAILURE;
+	}
+
+	return 0;
+}
+
+/*
+ * Script mode runs several operations on one open device, one command
+ * per line:
+ *   read file			read firmware to file
+ *   read-range addr len file	read len bytes at addr, in 2 KiB blocks
+ *   write file			erase, write and verify firmware
+ *   verify file		compare firmware on the device with file
+ *   info			print VID, PID, serial number and firmware CRC
+ *   serial [number]		rewrite serial number area, optionally with a new number
+ *   end			end programming, device resets
+ * Empty lines and lines starting with '#' are ignored.
+ */
+/*
+ * Images and bundles scripts and daemon jobs used last, so a station
+ * loads an image once and not for every unit. A file is loaded again
+ * when it changes.
+ */
+#define IMAGE_CACHE_SIZE 8
+
+struct cached_image {
+	char *file;
+	time_t mtime;
+	off_t size;
+	struct bundle *bundle;
+};
+
+static struct cached_image image_cache[IMAGE_CACHE_SIZE];
+static int image_cache_next;
+
+static struct bundle *image_get(const char *file)
+{
+	struct cached_image *ci;
+	struct bundle *bundle;
+	struct stat st;
+
+	if (stat(file, &st)) {
+		fprintf(stderr, "Failed to open %s for read\n", file);
+		return NULL;
+	}
+
+	for (int i = 0; i < IMAGE_CACHE_SIZE; i++) {
+		ci = &image_cache[i];
+		if (ci->file && !strcmp(ci->file, file) &&
+		    ci->mtime == st.st_mtime && ci->size == st.st_size)
+			return ci->bundle;
+	}
+
+	if (bundle_load(file, &bundle))
+		return NULL;
+
+	/* Replace the oldest entry */
+	ci = &image_cache[image_cache_next];
+	image_cache_next = (image_cache_next + 1) % IMAGE_CACHE_SIZE;
+	bundle_free(ci->bundle);
+	free(ci->file);
+	ci->file = strdup(file);
+	ci->mtime = st.st_mtime;
+	ci->size = st.st_size;
+	ci->bundle = bundle;
+
+	return bundle;
+}
+
+static int do_script_command(struct device *dev, int argc, char *argv[])
+{
+	unsigned char data[FIRMWARE_SIZE];
+	unsigned char record[8];
+	const struct flash_plan *plan;
+	struct bundle_variant *variant;
+	struct bundle *bundle;
+	int retries, res;
+
+	if (!strcmp(argv[0], "read") && argc == 2) {
+		if (do_read_fw(dev, data, FIRMWARE_SIZE))
+			return -1;
+		return save_image(argv[1], data, FIRMWARE_SIZE);
+	} else if (!strcmp(argv[0], "read-range") && argc == 4) {
+		long int addr = strtol(argv[1], NULL, 0);
+		long int len = strtol(argv[2], NULL, 0);
+		unsigned char *buf;
+
+		if (addr < 0 || addr > 0xffff || len <= 0 ||
+		    addr + len > 0x10000 || len % BLOCK_SIZE) {
+			fprintf(stderr, "Invalid range\n");
+			return -1;
+		}
+		buf = malloc(len);
+		res = do_read_range(dev, addr, buf, len);
+		if (!res)
+			res = save_image(argv[3], buf, len);
+		free(buf);
+		return res;
+	} else if ((!strcmp(argv[0], "write") || !strcmp(argv[0], "verify")) &&
+		   argc == 2) {
+		bundle = image_get(argv[1]);
+		if (!bundle)
+			return -1;
+		variant = bundle_select(dev, bundle);
+		if (!variant)
+			return -1;
+		plan = bundle_plan(variant);
+		dev->image_crc = plan->crc;
+		if (argv[0][0] == 'w') {
+			/* Same as -w, nothing is erased over a bad link */
+			res = link_probe(dev);
+			if (!res)
+				res = flash_image(dev, plan, 0);
+		} else {
+			retries = max_retries;
+			do {
+				phase_begin(dev, "verify");
+				res = do_read_fw(dev, data, plan->length);
+				if (!res && memcmp(plan->image, data, plan->length)) {
+					fprintf(stderr, "Firmware on device differs from %s\n",
+						argv[1]);
+					res = -1;
+					break;
+				}
+			} while (res && retries--);
+		}
+		return res;
+	} else if (!strcmp(argv[0], "info") && argc == 1) {
+		if (do_read_serial_area(dev, record) ||
+		    do_read_fw(dev, data, FIRMWARE_SIZE))
+			return -1;
+		printf("VID: %.2x%.2x PID: %.2x%.2x Serial: %.2x%.2x CRC: %08x\n",
+		       record[0], record[1], record[2], record[3], record[6],
+		       record[7], crc32(data, FIRMWARE_SIZE));
+		return 0;
+	} else if (!strcmp(argv[0], "serial") && argc <= 2) {
+		/* Without a number, the next one from the pool if there is one */
+		long int serial_num = argc == 2 ? strtol(argv[1], NULL, 0) :
+				      serial_pool ? SERIAL_FROM_POOL : -1;
+
+		if (argc == 2 && (serial_num < 0 || serial_num > 0xffff)) {
+			fprintf(stderr, "Invalid serial number: %s\n", argv[1]);
+			return -1;
+		}
+		return do_write_serial_number(dev, serial_num);
+	} else if (!strcmp(argv[0], "end") && argc == 1) {
+		return do_end_programming(dev);
+	}
+
+	fprintf(stderr, "Unknown command or wrong arguments: %s\n", argv[0]);
+	return -1;
+}
+
+/* A request size a bundle found out only holds for the device it was found on */
+static int script_command(struct device *dev, int argc, char *argv[])
+{
+	long int given = request_size;
+	int res;
+
+	if (dev->request_size)
+		request_size = dev->request_size;
+	res = do_script_command(dev, argc, argv);
+	request_size = given;
+
+	return res;
+}
+
+int run_script(void)
+{
+#define SCRIPT_MAX_ARGS 8
+	bool interactive;
+	struct device dev;
+	char line[PATH_MAX];
+	int lineno = 0, res;
+	FILE *in;
+
+	in = strcmp(script_file, "-") ? fopen(script_file, "r") : stdin;
+	if (!in) {
+		fprintf(stderr, "Failed to open %s for read\n", script_file);
+		return EXIT_FAILURE;
+	}
+	interactive = in == stdin && isatty(STDIN_FILENO);
 
-	handle = hid_open(USB_DEVICE_VID, USB_DEVICE_PID, NULL);
-	if (!handle) {
+	res = open_device(&dev);
+	if (res) {
 		fprintf(stderr, "Failed to open device\n");
-		exit(EXIT_FAILURE);
+		if (in != stdin)
+			fclose(in);
+		return res == -EBUSY ? EXIT_BUSY : EXIT_NO_DEVICE;
 	}
 
-	/* Erase pages 0-6 */
-	memset(report_data, 0x45, request_size);
-	report_data[0] = 0x05; /* report id */
-	res = hid_send_feature_report(handle, report_data, request_size);
-	if (res != request_size) {
-		fprintf(stderr, "Failed to send erase command\n");
-		goto err_out;
+	for (;;) {
+		char *argv[SCRIPT_MAX_ARGS];
+		int argc = 0;
+		char *tok;
+
+		if (interactive) {
+			printf("> ");
+			fflush(stdout);
+		}
+		if (!fgets(line, sizeof(line), in))
+			break;
+		lineno++;
+
+		for (tok = strtok(line, " \t\n"); tok && argc < SCRIPT_MAX_ARGS;
+		     tok = strtok(NULL, " \t\n"))
+			argv[argc++] = tok;
+		if (!argc || argv[0][0] == '#')
+			continue;
+
+		phase_begin(&dev, "script");
+		res = script_command(&dev, argc, argv);
+		trace_record(&dev, argv[0], res ? EXIT_FAILURE : 0);
+		dev.image_crc = 0;
+		if (!res) {
+			if (interactive)
+				printf("ok\n");
+			continue;
+		}
+
+		fprintf(stderr, "%s:%d: %s failed\n", script_file, lineno, argv[0]);
+		/* Keep the session going, the user can retry */
+		if (interactive)
+			continue;
+
+		close_device(&dev);
+		if (in != stdin)
+			fclose(in);
+		return EXIT_FAILURE;
 	}
 
-	retries = RETRIES;
-	do {
-		if (!do_write_fw(handle, data, sizeof(data)))
+	close_device(&dev);
+	if (in != stdin)
+		fclose(in);
+	return 0;
+}
+
+/*
+ * Station daemon. Clients connect to a UNIX socket and send jobs, one
+ * script command per line. Jobs of all clients run one at a time in the
+ * order they arrived, each on a freshly opened device, so hidapi and the
+ * images stay loaded between units. The output of a job is streamed back
+ * line by line, "- " before stdout and "! " before stderr lines, and the
+ * job ends with "= code", 0 on success or one of the exit codes.
+ */
+#define DAEMON_MAX_CLIENTS 32
+
+struct daemon_client {
+	int fd;				/* -1 if the slot is free */
+	size_t len;
+	char buf[PATH_MAX];
+};
+
+struct daemon_job {
+	struct daemon_client *client;
+	char line[PATH_MAX];
+	struct daemon_job *next;
+};
+
+struct daemon_output {
+	int client;
+	int pipes[2];			/* read ends, stdout and stderr */
+	int saved[2];
+	pthread_t thread;
+};
+
+static volatile sig_atomic_t daemon_stop;
+
+static void daemon_signal(int sig)
+{
+	daemon_stop = 1;
+}
+
+/* Clients do not block the station, one that does not read loses output */
+static void daemon_send(int fd, const char *tag, const char *text, size_t len)
+{
+	char buf[1100];
+	int n;
+
+	n = snprintf(buf, sizeof(buf), "%s%.*s\n", tag, (int)len, text);
+	if (write(fd, buf, n < sizeof(buf) ? n : sizeof(buf) - 1) < 0)
+		return;
+}
+
+static void *daemon_forward(void *arg)
+{
+	static const char *const tags[] = { "- ", "! " };
+	struct daemon_output *out = arg;
+	struct pollfd fds[2];
+	char buf[2][1024];
+	size_t len[2] = { 0, 0 };
+	int open = 2;
+
+	for (int i = 0; i < 2; i++) {
+		fds[i].fd = out->pipes[i];
+		fds[i].events = POLLIN;
+	}
+
+	while (open) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
 			break;
-		fprintf(stderr, "Failed to write firmware. Retrying... (%d attempts left)\n", retries);
-	} while (retries--);
+		}
 
-	retries = RETRIES;
+		for (int i = 0; i < 2; i++) {
+			ssize_t n;
+			char *nl;
 
-	do {
-		if (!do_read_fw(handle, read_data, sizeof(read_data))) {
-			if (!memcmp(data, read_data, sizeof(data)))
-				break;
-			else
-				fprintf(stderr, "Firmware read from device differs from written!\n");
+			if (!fds[i].revents)
+				continue;
+			n = read(fds[i].fd, buf[i] + len[i], sizeof(buf[i]) - len[i]);
+			if (n <= 0) {
+				/* Job is done, send what is left of the last line */
+				if (len[i])
+					daemon_send(out->client, tags[i], buf[i], len[i]);
+				fds[i].fd = -1;
+				open--;
+				continue;
+			}
+
+			len[i] += n;
+			while ((nl = memchr(buf[i], '\n', len[i])) ||
+			       len[i] == sizeof(buf[i])) {
+				size_t line = nl ? nl - buf[i] : len[i];
+
+				daemon_send(out->client, tags[i], buf[i], line);
+				if (nl)
+					line++;
+				memmove(buf[i], buf[i] + line, len[i] - line);
+				len[i] -= line;
+			}
 		}
-		fprintf(stderr, "Firmware comparison failed. Retrying... (%d attempts left)\n", retries);
-	} while (retries--);
+	}
 
-	if (!retries)
-		goto err_out;
+	return NULL;
+}
 
-	/* Write serial number */
-	res = do_write_serial_number(handle);
-	if (res) {
-		fprintf(stderr, "Failed to write serial number\n");
+/* Send stdout and stderr of the job to the client */
+static int daemon_redirect(struct daemon_output *out, int client)
+{
+	int p[2][2];
+
+	fflush(stdout);
+	fflush(stderr);
+	if (pipe(p[0]))
+		return -1;
+	if (pipe(p[1])) {
+		close(p[0][0]);
+		close(p[0][1]);
+		return -1;
+	}
+
+	out->client = client;
+	for (int i = 0; i < 2; i++) {
+		out->saved[i] = dup(STDOUT_FILENO + i);
+		dup2(p[i][1], STDOUT_FILENO + i);
+		close(p[i][1]);
+		out->pipes[i] = p[i][0];
+	}
+	pthread_create(&out->thread, NULL, daemon_forward, out);
+
+	return 0;
+}
+
+static void daemon_restore(struct daemon_output *out)
+{
+	fflush(stdout);
+	fflush(stderr);
+	/* Closes the write ends, the forwarder drains the pipes and exits */
+	for (int i = 0; i < 2; i++) {
+		dup2(out->saved[i], STDOUT_FILENO + i);
+		close(out->saved[i]);
+	}
+	pthread_join(out->thread, NULL);
+	close(out->pipes[0]);
+	close(out->pipes[1]);
+}
+
+static void daemon_devices(const struct device *dev)
+{
+	struct hid_device_info *devs, *cur;
+	char port[32];
+
+	if (dev->sim) {
+		printf("%s\n", dev->path);
+		return;
+	}
+
+	devs = hid_enumerate(USB_DEVICE_VID, USB_DEVICE_PID);
+	for (cur = devs; cur; cur = cur->next) {
+		if (cur->interface_number > 0)
+			continue;
+		if (usb_port_path(cur->path, port, sizeof(port)))
+			snprintf(port, sizeof(port), "unknown");
+		printf("%s port %s release 0x%04x\n", cur->path, port,
+		       (int)cur->release_number);
+	}
+	hid_free_enumeration(devs);
+}
+
+/* Simulated devices stay open so jobs see what earlier ones wrote */
+static int daemon_job(struct device *dev, char *line)
+{
+	const char *given = device_select;
+	char *argv[SCRIPT_MAX_ARGS];
+	char **args = argv;
+	int argc = 0, res;
+	char *tok;
+
+	for (tok = strtok(line, " \t\r"); tok && argc < SCRIPT_MAX_ARGS;
+	     tok = strtok(NULL, " \t\r"))
+		argv[argc++] = tok;
+
+	/* "@path" or "@port" first picks the device for this job */
+	if (argv[0][0] == '@') {
+		if (argc == 1) {
+			fprintf(stderr, "No command for %s\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+		if (dev->sim && strcmp(argv[0] + 1, dev->path)) {
+			fprintf(stderr, "No touchpad at %s\n", argv[0] + 1);
+			return EXIT_NO_DEVICE;
+		}
+		device_select = argv[0] + 1;
+		args++;
+		argc--;
+	}
+
+	if (!strcmp(args[0], "devices") && argc == 1) {
+		daemon_devices(dev);
+		device_select = given;
+		return 0;
+	}
+
+	if (!dev->sim) {
+		res = open_device(dev);
+		device_select = given;
+		if (res) {
+			fprintf(stderr, "Failed to open device\n");
+			return res == -EBUSY ? EXIT_BUSY : EXIT_NO_DEVICE;
+		}
+	}
+	device_select = given;
+	phase_begin(dev, "job");
+	res = script_command(dev, argc, args);
+	trace_record(dev, args[0], res ? EXIT_FAILURE : 0);
+	dev->image_crc = 0;
+	if (!dev->sim)
+		close_device(dev);
+
+	return res ? EXIT_FAILURE : 0;
+}
+
+/* Queue the complete lines the client sent, -1 once it is gone */
+static int daemon_receive(struct daemon_client *c, struct daemon_job ***tail)
+{
+	ssize_t n;
+	char *nl;
+
+	n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+	if (n <= 0)
+		return -1;
+	c->len += n;
+
+	while ((nl = memchr(c->buf, '\n', c->len))) {
+		size_t len = nl - c->buf;
+		struct daemon_job *job;
+
+		*nl = '\0';
+		if (strspn(c->buf, " \t\r") != len && c->buf[0] != '#') {
+			job = calloc(1, sizeof(*job));
+			job->client = c;
+			memcpy(job->line, c->buf, len + 1);
+			**tail = job;
+			*tail = &job->next;
+		}
+		memmove(c->buf, nl + 1, c->len - len - 1);
+		c->len -= len + 1;
+	}
+
+	if (c->len == sizeof(c->buf)) {
+		daemon_send(c->fd, "! ", "Command is too long", 19);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Queued jobs of a client that went away are not run */
+static void daemon_drop(struct daemon_client *c, struct daemon_job **queue,
+			struct daemon_job ***tail)
+{
+	struct daemon_job **job = queue;
+
+	while (*job) {
+		struct daemon_job *next = (*job)->next;
+
+		if ((*job)->client == c) {
+			free(*job);
+			*job = next;
+		} else {
+			job = &(*job)->next;
+		}
+	}
+	*tail = job;
+
+	close(c->fd);
+	c->fd = -1;
+	c->len = 0;
+}
+
+/* Jobs run as the daemon, so only its own user and root may send them */
+static bool daemon_peer_allowed(int fd)
+{
+#ifdef __linux__
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return false;
+
+	return cred.uid == 0 || cred.uid == geteuid();
+#else
+	uid_t uid;
+	gid_t gid;
+
+	if (getpeereid(fd, &uid, &gid))
+		return false;
+
+	return uid == 0 || uid == geteuid();
+#endif
+}
+
+int run_daemon(void)
+{
+	static struct daemon_client clients[DAEMON_MAX_CLIENTS];
+	struct pollfd fds[DAEMON_MAX_CLIENTS + 1];
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct daemon_job *queue = NULL, **tail = &queue;
+	struct sigaction sa;
+	struct device dev;
+	int listen_fd, res = EXIT_FAILURE;
+	mode_t mask;
+
+	if (strlen(daemon_socket) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path is too long: %s\n", daemon_socket);
+		return EXIT_FAILURE;
+	}
+	strcpy(addr.sun_path, daemon_socket);
+
+	memset(&dev, 0, sizeof(dev));
+	dev.lock_fd = -1;
+	if (simulate && open_device(&dev))
+		return EXIT_FAILURE;
+
+	/* Replace a socket left behind by a previous daemon */
+	unlink(daemon_socket);
+	/* Only the owner may connect, the socket is created 0600 */
+	mask = umask(0177);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0 ||
+	    bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(listen_fd, DAEMON_MAX_CLIENTS)) {
+		fprintf(stderr, "Failed to listen on %s: %s\n", daemon_socket,
+			strerror(errno));
+		umask(mask);
 		goto err_out;
 	}
+	umask(mask);
 
-	/* Send end programming command */
-	memset(report_data, 0x55, request_size);
-	report_data[0] = 0x05;
-	res = hid_send_feature_report(handle, report_data, request_size);
-	if (res != request_size) {
-		fprintf(stderr, "Failed to send end programming\n");
+	/* No SA_RESTART, poll() has to return on a signal */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (int i = 0; i < DAEMON_MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+	/* Job output has to reach clients line by line */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	printf("Listening on %s\n", daemon_socket);
+
+	while (!daemon_stop) {
+		struct daemon_output out;
+		struct daemon_job *job;
+		char status[16];
+		int code;
+
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		for (int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events = POLLIN;
+		}
+
+		/* Pick up new clients and jobs between jobs */
+		if (poll(fds, DAEMON_MAX_CLIENTS + 1, queue ? 0 : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+			goto err_out;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(listen_fd, NULL, NULL);
+			int i;
+
+			for (i = 0; fd >= 0 && i < DAEMON_MAX_CLIENTS; i++) {
+				if (clients[i].fd < 0)
+					break;
+			}
+			if (fd >= 0 && !daemon_peer_allowed(fd)) {
+				daemon_send(fd, "! ", "Permission denied", 17);
+				close(fd);
+			} else if (fd >= 0 && i == DAEMON_MAX_CLIENTS) {
+				daemon_send(fd, "! ", "Too many clients", 16);
+				close(fd);
+			} else if (fd >= 0) {
+				fcntl(fd, F_SETFL, O_NONBLOCK);
+				clients[i].fd = fd;
+			}
+		}
+
+		for (int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+			if (clients[i].fd >= 0 && fds[i + 1].revents &&
+			    daemon_receive(&clients[i], &tail))
+				daemon_drop(&clients[i], &queue, &tail);
+		}
+
+		job = queue;
+		if (!job)
+			continue;
+		queue = job->next;
+		if (!queue)
+			tail = &queue;
+
+		printf("Job: %s\n", job->line);
+		fflush(stdout);
+		if (daemon_redirect(&out, job->client->fd)) {
+			code = EXIT_FAILURE;
+		} else {
+			code = daemon_job(&dev, job->line);
+			daemon_restore(&out);
+		}
+		snprintf(status, sizeof(status), "%d", code);
+		daemon_send(job->client->fd, "= ", status, strlen(status));
+		printf("Job done: %d\n", code);
+		fflush(stdout);
+		free(job);
+	}
+	res = 0;
+
+err_out:
+	while (queue) {
+		struct daemon_job *next = queue->next;
+
+		free(queue);
+		queue = next;
+	}
+	for (int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0)
+			close(clients[i].fd);
+	}
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(daemon_socket);
+	}
+	if (dev.sim)
+		close_device(&dev);
+
+	return res;
+}
+
+/*
+ * Play a capture back against simulated touchpads, one per captured
+ * device. Results and returned data are compared with the capture, the
+ * simulation starts from blank flash so readback of a real device
+ * differs unless the capture wrote it first.
+ */
+int replay(void)
+{
+#define REPLAY_MAX_DEVICES 64
+	struct device devs[REPLAY_MAX_DEVICES];
+	unsigned char header[CAPTURE_HEADER_SIZE];
+	unsigned char data[BLOCK_SIZE + 2], buf[BLOCK_SIZE + 2];
+	struct capture_record rec;
+	unsigned long reports = 0, results = 0, payloads = 0;
+	uint64_t start, last, captured = 0;
+	int ret = EXIT_FAILURE;
+	FILE *in;
+	int res;
+
+	in = fopen(replay_file, "rb");
+	if (!in) {
+		fprintf(stderr, "Failed to open %s for read\n", replay_file);
+		return EXIT_FAILURE;
+	}
+	if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+	    memcmp(header, CAPTURE_MAGIC, 8) ||
+	    get_le(header + 8, 4) != CAPTURE_VERSION) {
+		fprintf(stderr, "%s is not a capture\n", replay_file);
+		fclose(in);
+		return EXIT_FAILURE;
+	}
+	request_size = get_le(header + 12, 4);
+	printf("Request size is %ld\n", request_size);
+
+	if (capture_file && capture_open()) {
+		fclose(in);
+		return EXIT_FAILURE;
+	}
+
+	memset(devs, 0, sizeof(devs));
+	start = last = now_us();
+	while (!(res = capture_read(in, &rec, data, sizeof(data)))) {
+		struct device *dev;
+		uint64_t now;
+
+		if (rec.device >= REPLAY_MAX_DEVICES) {
+			fprintf(stderr, "Too many devices in capture\n");
+			goto err_out;
+		}
+		dev = &devs[rec.device];
+		if (!dev->sim && sim_open(dev, rec.device))
+			goto err_out;
+
+		/* Keep the gaps between reports, the simulation has its own bus time */
+		now = now_us();
+		if (!replay_fast && rec.start > captured &&
+		    last + rec.start - captured > now)
+			usleep(last + rec.start - captured - now);
+
+		if (rec.get) {
+			memset(buf, 0, rec.length);
+			buf[0] = rec.id;
+			buf[1] = rec.opcode;
+			res = get_report(dev, buf, rec.length);
+		} else {
+			memcpy(buf, data, rec.length);
+			res = send_report(dev, buf, rec.length);
+		}
+
+		reports++;
+		captured = rec.start + rec.duration;
+		last = now_us();
+		if (res != rec.result) {
+			fprintf(stderr, "Report %lu (%.2x/%.2x %s): returned %d, captured %d\n",
+				reports, (int)rec.id, (int)rec.opcode,
+				rec.get ? "get" : "set", res, (int)rec.result);
+			results++;
+		} else if (rec.get && res > 2 && memcmp(buf + 2, data + 2, res - 2)) {
+			payloads++;
+		}
+	}
+	if (res < 0) {
+		fprintf(stderr, "%s is truncated\n", replay_file);
 		goto err_out;
 	}
 
-	hid_close(handle);
-	return;
+	printf("Replayed %lu reports in %.1f ms, captured in %.1f ms\n", reports,
+	       (now_us() - start) / 1000.0, captured / 1000.0);
+	printf("%lu results and %lu readbacks differ from the capture\n",
+	       results, payloads);
+	ret = results ? EXIT_FAILURE : 0;
 
 err_out:
-	hid_close(handle);
-	exit(EXIT_FAILURE);
+	for (int i = 0; i < REPLAY_MAX_DEVICES; i++) {
+		if (devs[i].sim)
+			close_device(&devs[i]);
+	}
+	fclose(in);
+
+	return ret;
 }
 
 int main(int argc, char *argv[])
 {
 	options_init(argc, argv);
 
-	if (!request_size) {
+	/* Bundles find it out, unless it has to be known up front */
+	if (!request_size && !replay_file &&
+	    (!do_write || simulate || capture_file || !is_bundle(firmware_file))) {
 		fprintf(stderr, "Request size is not specified!\n\n");
 		usage(argc, argv);
 		exit(EXIT_FAILURE);
 	}
 
-	printf("Request size is %ld\n", request_size);
+	if ((histogram_file || soak_count || soak_seconds) && !histogram_resolution)
+		histogram_resolution = HISTOGRAM_DEFAULT_RESOLUTION;
+	/* Printed however we exit */
+	if (histogram_resolution)
+		atexit(histogram_print);
+
+	if (reset_on_timeout && !report_timeout && !phase_timeout) {
+		fprintf(stderr, "--reset-on-timeout needs a report or phase timeout\n\n");
+		usage(argc, argv);
+		exit(EXIT_FAILURE);
+	}
+
+	if (simulate && ready_timeout) {
+		fprintf(stderr, "Simulated devices do not re-enumerate, --wait-ready is not supported\n\n");
+		usage(argc, argv);
+		exit(EXIT_FAILURE);
+	}
+
+	if (realtime_cpu >= 0) {
+		if (realtime_init())
+			exit(EXIT_FAILURE);
+		atexit(jitter_print);
+	}
+
+	if (replay_file) {
+		if (firmware_file || script_file || all_devices) {
+			fprintf(stderr, "Replay is mutually exclusive with read, write, script and --all\n\n");
+			usage(argc, argv);
+			exit(EXIT_FAILURE);
+		}
+		return replay();
+	}
+
+	if (request_size)
+		printf("Request size is %ld\n", request_size);
+
+	if (capture_file && capture_open())
+		exit(EXIT_FAILURE);
+	if (trace_file && trace_open())
+		exit(EXIT_FAILURE);
+
+	if (output_dir && !daemon_socket) {
+		fprintf(stderr, "--output-dir is only used with --daemon\n\n");
+		usage(argc, argv);
+		exit(EXIT_FAILURE);
+	}
+
+	if (daemon_socket) {
+		if (firmware_file || script_file || all_devices ||
+		    soak_count || soak_seconds) {
+			fprintf(stderr, "Daemon is mutually exclusive with read, write, script, soak and --all\n\n");
+			usage(argc, argv);
+			exit(EXIT_FAILURE);
+		}
+		return run_daemon();
+	}
+
+	if (calibrate) {
+		if (!do_write || all_devices || do_rollback || journal_file) {
+			fprintf(stderr, "--calibrate needs --write and does not support --all, --rollback and --journal\n\n");
+			usage(argc, argv);
+			exit(EXIT_FAILURE);
+		}
+		return calibrate_timing();
+	}
+
+	if (soak_count || soak_seconds) {
+		if (firmware_file || script_file || all_devices) {
+			fprintf(stderr, "Soak is mutually exclusive with read, write, script and --all\n\n");
+			usage(argc, argv);
+			exit(EXIT_FAILURE);
+		}
+		return soak();
+	}
+
+	if (script_file) {
+		if (firmware_file || all_devices) {
+			fprintf(stderr, "Script is mutually exclusive with read, write and --all\n\n");
+			usage(argc, argv);
+			exit(EXIT_FAILURE);
+		}
+		return run_script();
+	}
+
+	if (all_devices) {
+		if (!do_write || do_rollback || journal_file || ready_timeout ||
+		    device_select) {
+			fprintf(stderr, "--all only supports --write without --rollback, --journal, --wait-ready and --device\n\n");
+			usage(argc, argv);
+			exit(EXIT_FAILURE);
+		}
+		return write_fw_all();
+	}
 
 	if (do_read) {
 		read_fw();
 	} else if (do_write) {
-		printf("You have 5 seconds to press CTRL+C\n");
-		fflush(stdout);
-		sleep(5);
-		write_fw();
+		return write_fw();
 	} else {
 		fprintf(stderr, "Neither read or write are specified!\n\n");
 		usage(argc, argv);
@@ -0,0 +1,330 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Pinebook Touchpad Firmware Writer - simulated touchpad
+ *
+ * Copyright (C) 2018 Vasily Khoruzhick <anarsoul@gmail.com>
+ */
+
+/*
+ * Software model of the touchpad flash protocol, for exercising the
+ * writer without hardware. Reports take bus time, the device does not
+ * answer while it erases or programs, and faults can be injected into
+ * matching reports with a seeded generator so runs are repeatable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pbtp-sim.h"
+
+#define SIM_BLOCK_SIZE 2048
+#define SIM_FIRMWARE_SIZE (14 * 1024)
+#define SIM_SERIAL_AREA 0xff80
+#define SIM_SERIAL_PAGE 0xff00
+
+enum sim_fault {
+	SIM_FAULT_NONE,
+	SIM_FAULT_SHORT,
+	SIM_FAULT_TIMEOUT,
+	SIM_FAULT_CORRUPT,
+};
+
+static uint64_t sim_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64*, good enough for fault dice and cheap to seed */
+static double sim_random(struct sim_device *sim)
+{
+	sim->rng ^= sim->rng >> 12;
+	sim->rng ^= sim->rng << 25;
+	sim->rng ^= sim->rng >> 27;
+
+	return ((sim->rng * 0x2545f4914f6cdd1dULL) >> 11) / (double)(1ULL << 53);
+}
+
+void sim_default_timing(struct sim_timing *timing)
+{
+	timing->report_us = 1000;
+	timing->frame_us = 4000;
+	timing->program_us = 5000;
+	timing->erase_us = 50000;
+	timing->serial_erase_us = 20000;
+}
+
+void sim_default_faults(struct sim_faults *faults)
+{
+	memset(faults, 0, sizeof(*faults));
+	faults->opcode = -1;
+	faults->block = -1;
+	faults->hang_us = 1000000;
+	faults->seed = 1;
+}
+
+void sim_init(struct sim_device *sim, long int request_size,
+	      const struct sim_timing *timing, const struct sim_faults *faults)
+{
+	memset(sim, 0, sizeof(*sim));
+	sim->request_size = request_size;
+	sim->timing = *timing;
+	sim->faults = *faults;
+	sim->rng = faults->seed ? faults->seed : 1;
+
+	/* Erased flash with a factory serial record */
+	memset(sim->flash, 0xff, sizeof(sim->flash));
+	memcpy(sim->flash + SIM_SERIAL_AREA,
+	       "\x25\x8a\x00\x0c\x01\x00\x00\x01", 8);
+}
+
+/* Parse "key=value,..." into values, in the order of keys */
+static int sim_parse(const char *spec, const char *const *keys, double *values)
+{
+	const char *p = spec;
+
+	while (*p) {
+		const char *eq = strchr(p, '=');
+		char *end;
+		size_t len;
+		int i;
+
+		if (!eq)
+			return -1;
+		len = eq - p;
+		for (i = 0; keys[i]; i++)
+			if (strlen(keys[i]) == len && !strncmp(p, keys[i], len))
+				break;
+		if (!keys[i])
+			return -1;
+
+		values[i] = strtod(eq + 1, &end);
+		if (end == eq + 1 || (*end && *end != ','))
+			return -1;
+		p = *end ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+/* "report=us,frame=us,program=us,erase=us,serial-erase=us" */
+int sim_parse_timing(struct sim_timing *timing, const char *spec)
+{
+	static const char *const keys[] = {
+		"report", "frame", "program", "erase", "serial-erase", NULL
+	};
+	double v[] = {
+		timing->report_us, timing->frame_us, timing->program_us,
+		timing->erase_us, timing->serial_erase_us
+	};
+	int i;
+
+	if (sim_parse(spec, keys, v))
+		return -1;
+	for (i = 0; keys[i]; i++)
+		if (v[i] < 0)
+			return -1;
+
+	timing->report_us = v[0];
+	timing->frame_us = v[1];
+	timing->program_us = v[2];
+	timing->erase_us = v[3];
+	timing->serial_erase_us = v[4];
+
+	return 0;
+}
+
+/* "short=p,timeout=p,corrupt=p,opcode=n,block=n,hang=ms,seed=n" */
+int sim_parse_faults(struct sim_faults *faults, const char *spec)
+{
+	static const char *const keys[] = {
+		"short", "timeout", "corrupt", "opcode", "block", "hang",
+		"seed", NULL
+	};
+	double v[] = {
+		faults->short_p, faults->timeout_p, faults->corrupt_p,
+		faults->opcode, faults->block, faults->hang_us / 1000,
+		faults->seed
+	};
+	int i;
+
+	if (sim_parse(spec, keys, v))
+		return -1;
+	for (i = 0; i < 3; i++)
+		if (v[i] < 0 || v[i] > 1)
+			return -1;
+	if (v[5] < 0 || v[6] < 0)
+		return -1;
+
+	faults->short_p = v[0];
+	faults->timeout_p = v[1];
+	faults->corrupt_p = v[2];
+	faults->opcode = v[3];
+	faults->block = v[4];
+	faults->hang_us = v[5] * 1000;
+	faults->seed = v[6];
+
+	return 0;
+}
+
+/*
+ * Pick the fault, if any, for a report the device is about to handle.
+ * Every report takes exactly one draw, so a seed gives the same faults
+ * however the host is timed. For corruption *where is 0..1 into the data.
+ */
+static enum sim_fault sim_fault(struct sim_device *sim, const unsigned char *data,
+				bool get, double *where)
+{
+	const struct sim_faults *f = &sim->faults;
+	double dice = sim_random(sim);
+
+	if (f->opcode >= 0 && data[1] != f->opcode)
+		return SIM_FAULT_NONE;
+	if (f->block >= 0 &&
+	    (data[0] != 0x06 || sim->addr / SIM_BLOCK_SIZE != f->block))
+		return SIM_FAULT_NONE;
+
+	if (dice < f->timeout_p)
+		return SIM_FAULT_TIMEOUT;
+	dice -= f->timeout_p;
+	if (dice < f->short_p)
+		return SIM_FAULT_SHORT;
+	dice -= f->short_p;
+	if (get && data[0] == 0x06 && dice < f->corrupt_p) {
+		*where = dice / f->corrupt_p;
+		return SIM_FAULT_CORRUPT;
+	}
+
+	return SIM_FAULT_NONE;
+}
+
+/*
+ * Reports take bus time; a busy device does not answer at all. Faults
+ * are drawn before that, busy or not.
+ */
+static int sim_begin(struct sim_device *sim, const unsigned char *data,
+		     size_t len, bool get, enum sim_fault *fault, double *where)
+{
+	usleep(len > 64 ? sim->timing.frame_us : sim->timing.report_us);
+	sim->reports++;
+
+	*fault = sim_fault(sim, data, get, where);
+	if (sim_now_us() < sim->busy_until)
+		return -1;
+	if (*fault != SIM_FAULT_NONE)
+		sim->faults_injected++;
+
+	return 0;
+}
+
+static void sim_busy(struct sim_device *sim, long int us)
+{
+	sim->busy_until = sim_now_us() + us;
+}
+
+static void sim_program(struct sim_device *sim, const unsigned char *data,
+			size_t len)
+{
+	if (sim->addr + len > SIM_FLASH_SIZE)
+		len = SIM_FLASH_SIZE - sim->addr;
+	memcpy(sim->flash + sim->addr, data, len);
+	sim->addr += len;
+}
+
+int sim_send_feature_report(struct sim_device *sim, const unsigned char *data,
+			    size_t len)
+{
+	enum sim_fault fault;
+	double where;
+
+	if (sim_begin(sim, data, len, false, &fault, &where))
+		return -1;
+
+	if (fault == SIM_FAULT_TIMEOUT) {
+		usleep(sim->faults.hang_us);
+		return -1;
+	}
+	if (fault == SIM_FAULT_SHORT)
+		return len / 2;
+
+	if (data[0] == 0x06) {
+		if (len != SIM_BLOCK_SIZE + 2 || data[1] != 0x77)
+			return -1;
+		sim_program(sim, data + 2, SIM_BLOCK_SIZE);
+		sim_busy(sim, sim->timing.program_us);
+		return len;
+	}
+
+	if (data[0] != 0x05 || len != sim->request_size)
+		return -1;
+
+	switch (data[1]) {
+	case 0x45:
+		/* Mass erase holds the control transfer until it is done */
+		memset(sim->flash, 0xff, SIM_FIRMWARE_SIZE);
+		usleep(sim->timing.erase_us);
+		break;
+	case 0x52:
+	case 0x57:
+		sim->addr = data[2] | (data[3] << 8);
+		break;
+	case 0x65:
+		memset(sim->flash + SIM_SERIAL_PAGE, 0xff,
+		       SIM_FLASH_SIZE - SIM_SERIAL_PAGE);
+		sim_busy(sim, sim->timing.serial_erase_us);
+		break;
+	case 0x77:
+		sim_program(sim, data + 2, len - 2);
+		break;
+	case 0x55:
+		break;
+	default:
+		return -1;
+	}
+
+	return len;
+}
+
+int sim_get_feature_report(struct sim_device *sim, unsigned char *data,
+			   size_t len)
+{
+	enum sim_fault fault;
+	double where;
+	size_t n;
+
+	if (sim_begin(sim, data, len, true, &fault, &where))
+		return -1;
+
+	if (fault == SIM_FAULT_TIMEOUT) {
+		usleep(sim->faults.hang_us);
+		return -1;
+	}
+	if (fault == SIM_FAULT_SHORT)
+		return len / 2;
+
+	if (data[0] == 0x06) {
+		if (len != SIM_BLOCK_SIZE + 2)
+			return -1;
+		n = SIM_BLOCK_SIZE;
+	} else if (data[0] == 0x05 && len == sim->request_size) {
+		/* Short reads return four bytes whatever the report size */
+		n = 4;
+	} else {
+		return -1;
+	}
+
+	if (sim->addr + n > SIM_FLASH_SIZE)
+		return -1;
+	memcpy(data + 2, sim->flash + sim->addr, n);
+	sim->addr += n;
+
+	if (fault == SIM_FAULT_CORRUPT)
+		data[2 + (size_t)(where * n)] ^= 0x01;
+
+	return len;
+}
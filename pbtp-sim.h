@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Pinebook Touchpad Firmware Writer - simulated touchpad
+ *
+ * Copyright (C) 2018 Vasily Khoruzhick <anarsoul@gmail.com>
+ */
+
+#ifndef PBTP_SIM_H
+#define PBTP_SIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIM_FLASH_SIZE 0x10000
+
+/* All times in us */
+struct sim_timing {
+	long int report_us;		/* 0x05 report on the bus */
+	long int frame_us;		/* 2050 byte 0x06 report on the bus */
+	long int program_us;		/* device is busy after a 0x06 write */
+	long int erase_us;		/* 0x45 takes this long to complete */
+	long int serial_erase_us;	/* device is busy after 0x65 */
+};
+
+/* Probabilities are 0..1, opcode and block -1 match any */
+struct sim_faults {
+	double short_p;
+	double timeout_p;
+	double corrupt_p;
+	int opcode;
+	int block;
+	long int hang_us;		/* how long a timed out report blocks */
+	unsigned long seed;
+};
+
+struct sim_device {
+	long int request_size;
+	struct sim_timing timing;
+	struct sim_faults faults;
+	uint64_t rng;
+	unsigned int addr;
+	uint64_t busy_until;
+	unsigned long reports;
+	unsigned long faults_injected;
+	unsigned char flash[SIM_FLASH_SIZE];
+};
+
+void sim_init(struct sim_device *sim, long int request_size,
+	      const struct sim_timing *timing, const struct sim_faults *faults);
+void sim_default_timing(struct sim_timing *timing);
+void sim_default_faults(struct sim_faults *faults);
+int sim_parse_timing(struct sim_timing *timing, const char *spec);
+int sim_parse_faults(struct sim_faults *faults, const char *spec);
+
+/* Same contract as hid_send_feature_report() and hid_get_feature_report() */
+int sim_send_feature_report(struct sim_device *sim, const unsigned char *data,
+			    size_t len);
+int sim_get_feature_report(struct sim_device *sim, unsigned char *data,
+			   size_t len);
+
+#endif
@@ -0,0 +1,281 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Pinebook Touchpad Firmware Writer - virtual touchpad over uhid
+ *
+ * Copyright (C) 2018 Vasily Khoruzhick <anarsoul@gmail.com>
+ */
+
+/*
+ * Creates a 0x258a:0x000c HID device through /dev/uhid that answers
+ * feature reports with the simulated touchpad, so the writer can be run
+ * unmodified through hidapi, hidraw and the kernel without hardware.
+ * The device exists until the tool is interrupted.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/uhid.h>
+
+#include "pbtp-sim.h"
+
+#define USB_DEVICE_VID 0x258a
+#define USB_DEVICE_PID 0x000c
+#define BUS_USB 0x03
+
+static long int request_size;
+static struct sim_timing sim_timing;
+static struct sim_faults sim_faults;
+static volatile sig_atomic_t stop;
+
+static void usage(int argc, char *argv[])
+{
+	fprintf(stderr, "Usage: %s [options]\n\n"
+	       "-s size | --request_size size	Feature request size the device accepts\n"
+	       "-t spec | --timing spec	Timing in us: report=,frame=,program=,erase=,serial-erase=\n"
+	       "-f spec | --faults spec	Inject faults: short=p,timeout=p,corrupt=p,opcode=n,block=n,hang=ms,seed=n\n"
+	       "-h | --help		Print this message\n", argv[0]);
+}
+
+static const char short_options[] = "s:t:f:h";
+
+static const struct option long_options[] = {
+	{"request_size", required_argument, NULL, 's'},
+	{"timing", required_argument, NULL, 't'},
+	{"faults", required_argument, NULL, 'f'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, 0, 0}
+};
+
+void options_init(int argc, char *argv[])
+{
+	sim_default_timing(&sim_timing);
+	sim_default_faults(&sim_faults);
+
+	for (;;) {
+		int index;
+		int c;
+
+		c = getopt_long(argc, argv, short_options, long_options,
+				&index);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 's':
+			request_size = strtol(optarg, NULL, 0);
+			if (errno == ERANGE || request_size < 6 || request_size > 256) {
+				fprintf(stderr, "Invalid request size: %s\n\n", optarg);
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			if (sim_parse_timing(&sim_timing, optarg)) {
+				fprintf(stderr, "Invalid timing: %s\n\n", optarg);
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'f':
+			if (sim_parse_faults(&sim_faults, optarg)) {
+				fprintf(stderr, "Invalid fault spec: %s\n\n", optarg);
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'h':
+			usage(argc, argv);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argc, argv);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Vendor collection with feature report 5 of request_size bytes and
+ * feature report 6 of 2050 bytes, both counting the report id.
+ */
+static size_t report_descriptor(unsigned char *rd)
+{
+	long int count5 = request_size - 1, count6 = 2049;
+	const unsigned char desc[] = {
+		0x06, 0x00, 0xff,	/* Usage Page (Vendor Defined) */
+		0x09, 0x01,		/* Usage (1) */
+		0xa1, 0x01,		/* Collection (Application) */
+		0x15, 0x00,		/*   Logical Minimum (0) */
+		0x26, 0xff, 0x00,	/*   Logical Maximum (255) */
+		0x75, 0x08,		/*   Report Size (8) */
+		0x85, 0x05,		/*   Report ID (5) */
+		0x09, 0x01,		/*   Usage (1) */
+		0x96, count5 & 0xff, count5 >> 8,	/* Report Count */
+		0xb1, 0x02,		/*   Feature (Data, Var, Abs) */
+		0x85, 0x06,		/*   Report ID (6) */
+		0x09, 0x01,		/*   Usage (1) */
+		0x96, count6 & 0xff, count6 >> 8,	/* Report Count */
+		0xb1, 0x02,		/*   Feature (Data, Var, Abs) */
+		0xc0,			/* End Collection */
+	};
+
+	memcpy(rd, desc, sizeof(desc));
+	return sizeof(desc);
+}
+
+static int uhid_write(int fd, const struct uhid_event *ev)
+{
+	ssize_t res = write(fd, ev, sizeof(*ev));
+
+	if (res != sizeof(*ev)) {
+		fprintf(stderr, "Failed to write to uhid: %s\n",
+			res < 0 ? strerror(errno) : "short write");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int uhid_create(int fd)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name),
+		 "Simulated Pinebook Touchpad");
+	ev.u.create2.rd_size = report_descriptor(ev.u.create2.rd_data);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = USB_DEVICE_VID;
+	ev.u.create2.product = USB_DEVICE_PID;
+
+	return uhid_write(fd, &ev);
+}
+
+/* Report buffers handed over by the kernel start with the report id */
+static int handle_get_report(int fd, struct sim_device *sim,
+			     const struct uhid_get_report_req *req)
+{
+	struct uhid_event ev;
+	size_t len = req->rnum == 0x06 ? 2050 : request_size;
+	int res;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_GET_REPORT_REPLY;
+	ev.u.get_report_reply.id = req->id;
+	ev.u.get_report_reply.data[0] = req->rnum;
+
+	res = sim_get_feature_report(sim, ev.u.get_report_reply.data, len);
+	if (res < 0)
+		ev.u.get_report_reply.err = EIO;
+	else
+		ev.u.get_report_reply.size = res;
+
+	return uhid_write(fd, &ev);
+}
+
+static int handle_set_report(int fd, struct sim_device *sim,
+			     const struct uhid_set_report_req *req)
+{
+	struct uhid_event ev;
+	int res;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_SET_REPORT_REPLY;
+	ev.u.set_report_reply.id = req->id;
+
+	/* A set can not complete partially, short ones fail */
+	res = sim_send_feature_report(sim, req->data, req->size);
+	if (res != req->size)
+		ev.u.set_report_reply.err = EIO;
+
+	return uhid_write(fd, &ev);
+}
+
+static void handle_signal(int sig)
+{
+	stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sim_device *sim;
+	struct sigaction sa;
+	struct uhid_event ev;
+	int fd, ret = EXIT_FAILURE;
+
+	options_init(argc, argv);
+
+	if (!request_size) {
+		fprintf(stderr, "Request size is not specified!\n\n");
+		usage(argc, argv);
+		exit(EXIT_FAILURE);
+	}
+
+	sim = malloc(sizeof(*sim));
+	if (!sim)
+		return EXIT_FAILURE;
+	sim_init(sim, request_size, &sim_timing, &sim_faults);
+
+	fd = open("/dev/uhid", O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open /dev/uhid: %s\n", strerror(errno));
+		free(sim);
+		return EXIT_FAILURE;
+	}
+
+	/* No SA_RESTART, read() below has to return on a signal */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (uhid_create(fd))
+		goto err_out;
+	printf("Virtual touchpad created, request size is %ld. Press CTRL+C to remove it\n",
+	       request_size);
+	fflush(stdout);
+
+	while (!stop) {
+		ssize_t res = read(fd, &ev, sizeof(ev));
+
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed to read from uhid: %s\n", strerror(errno));
+			goto err_out;
+		}
+
+		switch (ev.type) {
+		case UHID_GET_REPORT:
+			if (handle_get_report(fd, sim, &ev.u.get_report))
+				goto err_out;
+			break;
+		case UHID_SET_REPORT:
+			if (handle_set_report(fd, sim, &ev.u.set_report))
+				goto err_out;
+			break;
+		default:
+			/* start, stop, open, close and output need no answer */
+			break;
+		}
+	}
+
+	printf("%lu reports, %lu faults injected\n", sim->reports,
+	       sim->faults_injected);
+	ret = 0;
+
+err_out:
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	uhid_write(fd, &ev);
+	close(fd);
+	free(sim);
+
+	return ret;
+}